@@ -0,0 +1,226 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include "bitcache.h"
+
+// "BCC1" and the slots of a new cache file, 48 bytes each (3M)
+#define CACHE_MAGIC 0x31434342
+#define CACHE_SLOTS (64 * 1024)
+// Slots looked at for a key before the first one is taken over
+#define CACHE_PROBES 16
+// Times a reader waits for a slot being written; a slot still being
+// written after that is taken over by the next writer
+#define CACHE_RETRIES 64
+
+struct cache_header_s
+{
+    uint32_t magic;
+    uint32_t slots;
+    uint8_t unused[56];
+};
+
+// One file in the open addressed table. seq is 0 while the slot was never
+// used, odd while a writer is changing it and goes up by 2 for each change,
+// so readers can copy a slot without a lock and see whether it changed.
+// check covers the rest of the slot: a writer that was taken over can
+// still land stores after the new one published, and the check is how
+// readers tell.
+// The fields are accessed atomically because other processes may write them.
+struct cache_slot_s
+{
+    uint32_t seq;
+    uint32_t check;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint64_t bits;
+};
+
+struct bitcache_s *openCache(const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+        return NULL;
+    // Only one process makes a new file into a cache
+    flock(fd, LOCK_EX);
+    struct stat stat;
+    if (fstat(fd, &stat) == -1)
+        goto fail;
+    off_t size = stat.st_size;
+    int created = size == 0;
+    if (created)
+    {
+        size = sizeof(struct cache_header_s) + (off_t)CACHE_SLOTS * sizeof(struct cache_slot_s);
+        // The slots are zero, that is never used, and take no disk until written
+        if (ftruncate(fd, size) == -1)
+            goto fail;
+    }
+    struct cache_header_s *header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED)
+        goto fail;
+    if (created)
+    {
+        header->slots = CACHE_SLOTS;
+        __atomic_store_n(&header->magic, CACHE_MAGIC, __ATOMIC_RELEASE);
+    }
+    // The number of slots has to be a power of 2 and fill the file
+    uint32_t slots = header->slots;
+    if (header->magic != CACHE_MAGIC || slots == 0 || (slots & (slots - 1)) ||
+        size != (off_t)(sizeof(struct cache_header_s) + (off_t)slots * sizeof(struct cache_slot_s)))
+    {
+        munmap(header, size);
+        errno = EINVAL;
+        goto fail;
+    }
+    flock(fd, LOCK_UN);
+    struct bitcache_s *cache = malloc(sizeof(struct bitcache_s));
+    cache->fd = fd;
+    cache->slots = slots;
+    cache->header = header;
+    cache->slot = (struct cache_slot_s *)(header + 1);
+    return cache;
+fail:;
+    int error = errno;
+    close(fd);
+    errno = error;
+    return NULL;
+}
+
+void closeCache(struct bitcache_s *cache)
+{
+    munmap(cache->header, sizeof(struct cache_header_s) + (size_t)cache->slots * sizeof(struct cache_slot_s));
+    close(cache->fd);
+    free(cache);
+}
+
+void cacheKey(const struct stat *stat, struct cache_key_s *key)
+{
+    key->dev = stat->st_dev;
+    key->ino = stat->st_ino;
+    key->size = stat->st_size;
+    key->mtime_ns = stat->st_mtim.tv_sec * 1000000000ULL + stat->st_mtim.tv_nsec;
+}
+
+// Slot a file starts probing from
+static uint32_t homeSlot(struct bitcache_s *cache, const struct cache_key_s *key)
+{
+    uint64_t hash = (key->ino ^ (key->dev << 32 | key->dev >> 32)) * 0x9E3779B97F4A7C15ULL;
+    return (hash >> 32) & (cache->slots - 1);
+}
+
+// Check word of what a slot holds
+static uint32_t slotCheck(const struct cache_slot_s *slot)
+{
+    uint64_t words[] = {slot->dev, slot->ino, slot->size, slot->mtime_ns, slot->bits};
+    uint64_t hash = 0;
+    for (int i = 0; i < 5; i++)
+        hash = (hash ^ words[i]) * 0x9E3779B97F4A7C15ULL;
+    return hash ^ hash >> 32;
+}
+
+// Copy a slot that isn't being written, 0 if writers kept changing it or
+// it doesn't match its check
+static int readSlot(struct cache_slot_s *slot, struct cache_slot_s *copy)
+{
+    for (int retry = 0; retry < CACHE_RETRIES; retry++)
+    {
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        copy->check = __atomic_load_n(&slot->check, __ATOMIC_RELAXED);
+        copy->dev = __atomic_load_n(&slot->dev, __ATOMIC_RELAXED);
+        copy->ino = __atomic_load_n(&slot->ino, __ATOMIC_RELAXED);
+        copy->size = __atomic_load_n(&slot->size, __ATOMIC_RELAXED);
+        copy->mtime_ns = __atomic_load_n(&slot->mtime_ns, __ATOMIC_RELAXED);
+        copy->bits = __atomic_load_n(&slot->bits, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+        {
+            copy->seq = seq;
+            return seq == 0 || copy->check == slotCheck(copy);
+        }
+    }
+    return 0;
+}
+
+int lookupCache(struct bitcache_s *cache, const struct cache_key_s *key, uint64_t *bits)
+{
+    uint32_t home = homeSlot(cache, key);
+    for (int probe = 0; probe < CACHE_PROBES; probe++)
+    {
+        struct cache_slot_s copy;
+        if (!readSlot(&cache->slot[(home + probe) & (cache->slots - 1)], &copy))
+            continue;
+        // A slot that was never used ends the probing
+        if (copy.seq == 0)
+            return 0;
+        if (copy.dev == key->dev && copy.ino == key->ino)
+        {
+            if (copy.size != key->size || copy.mtime_ns != key->mtime_ns)
+                return 0;
+            *bits = copy.bits;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Take a slot from seq to write it, 0 if someone else has it or changed it.
+// From an even seq the next odd one is ours; from an odd one, which
+// belongs to a writer that died or stalled, the odd one after it.
+static int claimSlot(struct cache_slot_s *slot, uint32_t seq)
+{
+    return __atomic_compare_exchange_n(&slot->seq, &seq, seq + 1 + (seq & 1), 0, __ATOMIC_ACQUIRE,
+                                       __ATOMIC_RELAXED);
+}
+
+// Write a slot claimed from seq and publish it, unless it was taken over
+// meanwhile: then the new writer publishes it
+static void writeSlot(struct cache_slot_s *slot, uint32_t seq, const struct cache_key_s *key, uint64_t bits)
+{
+    struct cache_slot_s copy = {0, 0, key->dev, key->ino, key->size, key->mtime_ns, bits};
+    __atomic_store_n(&slot->dev, key->dev, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->ino, key->ino, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->size, key->size, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->mtime_ns, key->mtime_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->bits, bits, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->check, slotCheck(&copy), __ATOMIC_RELAXED);
+    uint32_t claimed = seq + 1 + (seq & 1);
+    __atomic_compare_exchange_n(&slot->seq, &claimed, claimed + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+// The slot of the file if it is in the cache, else the first one never
+// used; if there is neither, the home slot is taken over. A slot that
+// can't be read, because its writer died or stalled half way or left it
+// torn, is taken over where it is: nobody can use it as it is, and losing
+// a count only costs a recount.
+void storeCache(struct bitcache_s *cache, const struct cache_key_s *key, uint64_t bits)
+{
+    uint32_t home = homeSlot(cache, key);
+    for (int probe = 0; probe < CACHE_PROBES; probe++)
+    {
+        struct cache_slot_s *slot = &cache->slot[(home + probe) & (cache->slots - 1)];
+        struct cache_slot_s copy;
+        if (!readSlot(slot, &copy))
+            copy.seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        else if (copy.seq != 0 && (copy.dev != key->dev || copy.ino != key->ino))
+            continue;
+        // Nobody wrote the slot since it was read, so it is still this
+        // file's, still unused or still stuck
+        if (claimSlot(slot, copy.seq))
+            writeSlot(slot, copy.seq, key, bits);
+        return;
+    }
+    struct cache_slot_s *slot = &cache->slot[home];
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (claimSlot(slot, seq))
+        writeSlot(slot, seq, key, bits);
+}
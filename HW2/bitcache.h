@@ -0,0 +1,34 @@
+#include <stdint.h>
+#include <sys/stat.h>
+#pragma once
+
+// What identifies a version of a file in the cache: the file by its
+// device and inode, the version by its size and modification time
+struct cache_key_s
+{
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+};
+
+// An open cache file, mapped shared so that every process that has it
+// open sees the same counts
+struct bitcache_s
+{
+    int fd;
+    uint32_t slots;
+    struct cache_header_s *header;
+    struct cache_slot_s *slot;
+};
+
+// Open or create a cache file, NULL with errno set if it can't be mapped
+// or isn't a cache
+struct bitcache_s *openCache(const char *path);
+void closeCache(struct bitcache_s *cache);
+// The key of the file stat describes
+void cacheKey(const struct stat *stat, struct cache_key_s *key);
+// 1 with the bits of the file if this version of it is in the cache, else 0
+int lookupCache(struct bitcache_s *cache, const struct cache_key_s *key, uint64_t *bits);
+// Put the bits of a version of a file in the cache, replacing older ones
+void storeCache(struct bitcache_s *cache, const struct cache_key_s *key, uint64_t bits);
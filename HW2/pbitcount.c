@@ -1,86 +1,643 @@
+// Build with: gcc -O2 -pthread -o pbitcount pbitcount.c popcount.c bitcache.c util.c
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
-//#include <stdlib.h>
 //#include <stdbool.h>
-#define MSGSIZE 4
+#include "bitcache.h"
+#include "popcount.h"
+#include "util.h"
 
-int intBitCounter(int i);
-int bitCounter(FILE *fh);
+// Bytes read at a time from files that can't be mapped, and their alignment
+#define READ_SIZE (1024 * 1024)
+#define READ_ALIGN 4096
+// Bytes of a file one worker counts, unless -c says otherwise
+#define CHUNK_SIZE (64 * 1024 * 1024)
+
+// What the reader thread of a stream and its counter share: two buffers,
+// one filled by the reader while the other is counted
+struct stream_s
+{
+    int fd;
+    uint8_t *bufs[2];
+    // bytes in each buffer, 0 at the end of the stream and -1 if reading
+    // failed; full says the reader is done with the buffer
+    ssize_t lens[2];
+    int full[2];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+// I/O paths of -i for regular files; others are always streamed
+#define IO_MAP 0
+#define IO_READ 1
+#define IO_STREAM 2
+
+// Report formats of -r
+#define REPORT_NONE 0
+#define REPORT_TEXT 1
+#define REPORT_JSON 2
+
+// What was counted in a file or part of one; with -s also how often each
+// byte value occurs and how often each bit of a byte is set
+struct counts_s
+{
+    uint64_t bits;
+    uint64_t bytes;
+    uint64_t positions[8];
+    uint64_t histogram[256];
+};
+
+// What a worker sends back through the pipe: the argv index of its file,
+// the counts of its part of the file and how long counting took
+// Less than PIPE_BUF bytes, so one write is never split
+struct result_s
+{
+    int file;
+    uint64_t count_ns;
+    struct counts_s counts;
+};
+
+// A running worker
+struct worker_s
+{
+    pid_t pid;
+    int file;
+    uint64_t start_ns;
+};
+
+// Counts and timing of one file, for the report
+struct file_s
+{
+    struct counts_s counts;
+    int chunks;
+    // with -C: whether the file can be kept in the cache, what it is
+    // kept under and whether its count came from there
+    int cacheable;
+    int cached;
+    struct cache_key_s key;
+    // from forking the first worker until the last one is done
+    uint64_t start_ns;
+    uint64_t end_ns;
+};
+
+// Timing of the whole run, for the report
+struct run_s
+{
+    uint64_t wall_ns;
+    // time spent counting, added up over the workers
+    uint64_t count_ns;
+    // the rest of the workers' lives: fork, mapping, exit, pipe and wait
+    uint64_t overhead_ns;
+    // time the parent spent in fork, while earlier workers already count
+    uint64_t fork_ns;
+    int workers;
+};
+
+void worker(int out, int file, int fd, off_t offset, off_t length);
+int bitCounter(int fd, off_t offset, off_t length, struct counts_s *counts);
+int mappedBitCounter(int fd, off_t offset, off_t length, struct counts_s *counts);
+int readBitCounter(int fd, off_t offset, off_t length, struct counts_s *counts);
+int streamBitCounter(int fd, struct counts_s *counts);
+void *streamReader(void *arg);
+ssize_t fillBuffer(int fd, uint8_t *buf);
+void countBuffer(const uint8_t *buf, size_t len, struct counts_s *counts);
+void addCounts(struct counts_s *to, const struct counts_s *counts);
+double gbPerSecond(uint64_t bytes, uint64_t ns);
+void printTextReport(char *names[], struct file_s *files, int first, int last, struct run_s *run);
+void printTextStats(const struct counts_s *counts);
+void printJsonString(const char *str);
+void printJsonStats(const struct counts_s *counts);
+void printJsonReport(char *names[], struct file_s *files, int first, int last, struct run_s *run);
+
+// Counting kernel, picked for this CPU or with -k
+popcount_f countBits;
+// -s: count byte values and bit positions in the same pass
+int stats = 0;
+// How regular files are read, -i
+int ioPath = IO_MAP;
+// Counts of files counted before, -C
+struct bitcache_s *cache = NULL;
 
 int main(int argc, char *argv[])
 {
     int fds[2];
     pipe(fds);
-    int total = 0;
+    struct counts_s total;
+    memset(&total, 0, sizeof(total));
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    off_t chunk = CHUNK_SIZE;
+    int report = REPORT_NONE;
+    countBits = pickPopcount();
+    int opt;
+    while ((opt = getopt(argc, argv, "k:j:c:r:si:C:")) != -1)
+    {
+        if (opt == 'k')
+            countBits = findPopcount(optarg);
+        else if (opt == 'j')
+            jobs = atoi(optarg);
+        else if (opt == 'c')
+            chunk = parseSize(optarg);
+        else if (opt == 's')
+            stats = 1;
+        else if (opt == 'C' && (cache = openCache(optarg)) == NULL)
+        {
+            perror(optarg);
+            return 2;
+        }
+        else if (opt == 'C')
+            continue;
+        else if (opt == 'i' && strcmp(optarg, "map") == 0)
+            ioPath = IO_MAP;
+        else if (opt == 'i' && strcmp(optarg, "read") == 0)
+            ioPath = IO_READ;
+        else if (opt == 'i' && strcmp(optarg, "stream") == 0)
+            ioPath = IO_STREAM;
+        else if (opt == 'r' && strcmp(optarg, "text") == 0)
+            report = REPORT_TEXT;
+        else if (opt == 'r' && strcmp(optarg, "json") == 0)
+            report = REPORT_JSON;
+        else
+            jobs = 0;
+    }
     // Check for right amount of arguments
-    if (argc < 2)
+    if (optind >= argc || countBits == NULL || jobs < 1 || chunk < 1)
     {
-        printf("USAGE: ./bitcount filenames\n");
+        printf("USAGE: ./bitcount [-j jobs] [-c chunk] [-k kernel] [-i io] [-r text|json] [-s] [-C cache] filenames\n");
+        printf("filenames: files, pipes or devices; - is standard input\n");
+        printf("jobs: workers at once, the number of cores by default\n");
+        printf("chunk: bytes of a file per worker, with K, M or G (64M)\n");
+        printf("io: map regular files (default), read them in chunks or stream them whole\n");
+        printf("-r: report bytes, bits, time and throughput per file and of the workers\n");
+        printf("-s: also count each byte value and the bits set at each bit position\n");
+        printf("-C: keep the bits of regular files in a cache file and count only files\n");
+        printf("    that are new or changed since; not with -s\n");
+        printf("kernels this CPU can run:");
+        for (const struct popcount_kernel_s *kernel = popcountKernels; kernel->name; kernel++)
+            if (kernel->supported())
+                printf(" %s", kernel->name);
+        printf("\n");
         return 1;
     }
-    for (int i = 1; i < argc; i++)
+    struct worker_s *workers = calloc(jobs, sizeof(struct worker_s));
+    struct file_s *files = calloc(argc, sizeof(struct file_s));
+    struct run_s run = {0, 0, 0, 0, jobs};
+    uint64_t start_ns = nowNs();
+    int next = optind;
+    int running = 0;
+    int code = 0;
+    // File being handed out to workers a chunk at a time; pipes and other
+    // files that aren't regular go to one worker whole (size -1)
+    int fd = -1;
+    int file = 0;
+    off_t size = 0;
+    off_t offset = 0;
+    while (running > 0 || ((fd != -1 || next < argc) && code == 0))
     {
-        FILE *fh = fopen(argv[i], "r");
-        // Validate child before forking
-        if (fh == NULL)
+        // Keep jobs workers busy
+        while (running < jobs && (fd != -1 || next < argc) && code == 0)
         {
-            perror(argv[i]);
-            return 2;
+            if (fd == -1)
+            {
+                // - is standard input; it gets its own descriptor to close
+                fd = strcmp(argv[next], "-") == 0 ? dup(STDIN_FILENO) : open(argv[next], O_RDONLY);
+                // Validate child before forking
+                if (fd == -1)
+                {
+                    perror(argv[next]);
+                    code = 2;
+                    break;
+                }
+                struct stat stat;
+                int regular = fstat(fd, &stat) == 0 && S_ISREG(stat.st_mode);
+                if (regular && ioPath != IO_STREAM)
+                    size = stat.st_size;
+                else
+                    size = -1;
+                file = next++;
+                offset = 0;
+                files[file].start_ns = nowNs();
+                // The file is known to the cache as it was opened; if it
+                // changes while it is counted, it is counted again next time
+                if (cache && !stats && regular)
+                {
+                    files[file].cacheable = 1;
+                    cacheKey(&stat, &files[file].key);
+                    struct counts_s cached;
+                    memset(&cached, 0, sizeof(cached));
+                    cached.bytes = stat.st_size;
+                    if (lookupCache(cache, &files[file].key, &cached.bits))
+                    {
+                        files[file].cached = 1;
+                        files[file].end_ns = nowNs();
+                        addCounts(&total, &cached);
+                        addCounts(&files[file].counts, &cached);
+                        close(fd);
+                        fd = -1;
+                        continue;
+                    }
+                }
+            }
+            off_t length = size == -1 || size - offset < chunk ? size - offset : chunk;
+            uint64_t fork_ns = nowNs();
+            pid_t pid = fork();
+            // No worker for this part: stop handing out work, but still
+            // wait for the workers that are running
+            if (pid == -1)
+            {
+                perror("fork");
+                code = 3;
+                break;
+            }
+            // Child - determine bits in its part of the file
+            if (pid == 0)
+            {
+                close(fds[0]);
+                worker(fds[1], file, fd, offset, size == -1 ? -1 : length);
+            }
+            // The chunk is handed out only now that a worker counts it:
+            // a failed fork leaves offset and chunks where they were
+            files[file].chunks++;
+            offset += length;
+            if (size == -1 || offset >= size)
+            {
+                close(fd);
+                fd = -1;
+            }
+            int slot = 0;
+            while (workers[slot].pid)
+                slot++;
+            workers[slot].pid = pid;
+            workers[slot].file = file;
+            workers[slot].start_ns = fork_ns;
+            run.fork_ns += nowNs() - fork_ns;
+            running++;
         }
-        int pid = fork();
-        // Child - determine bits in a file
-        if (pid == 0)
+        // Parent - wait for any worker to finish
+        int status;
+        pid_t pid = wait(&status);
+        if (pid == -1)
+            break;
+        uint64_t end_ns = nowNs();
+        running--;
+        int slot = 0;
+        while (workers[slot].pid != pid)
+            slot++;
+        workers[slot].pid = 0;
+        run.overhead_ns += end_ns - workers[slot].start_ns;
+        files[workers[slot].file].end_ns = end_ns;
+        // A worker that exits normally has written its result before it
+        // exited, so there is at least one result to read; it may be
+        // another worker's, results say which file they are for. A result
+        // that can't be read whole counts as a failed worker.
+        struct result_s result;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+            read(fds[0], &result, sizeof(result)) == sizeof(result))
         {
-            int bits = bitCounter(fh);
-            // Write file bits
-            // Here, I used MSGSIZE rather than sizeof bits
-            write(fds[1], &bits, MSGSIZE);
-            // Delete child process
-            _exit(0);
+            // Add the bits to the total
+            addCounts(&total, &result.counts);
+            addCounts(&files[result.file].counts, &result.counts);
+            run.count_ns += result.count_ns;
         }
-        // Parent - add result from child to total bits
         else
         {
-            // Wait for child to finish
-            wait(NULL);
-            int filebits;
-            // Read in file bits
-            read(fds[0], &filebits, MSGSIZE);
-            // Add file bits to total
-            total += filebits;
+            fprintf(stderr, "%s: worker failed\n", argv[workers[slot].file]);
+            if (code == 0)
+                code = 3;
+        }
+    }
+    run.wall_ns = nowNs() - start_ns;
+    // the worker lives include the counting
+    run.overhead_ns = run.overhead_ns > run.count_ns ? run.overhead_ns - run.count_ns : 0;
+    if (fd != -1)
+        close(fd);
+    free(workers);
+    // Keep the files counted this time for the next; not if a worker failed
+    if (cache && code == 0)
+        for (int i = optind; i < argc; i++)
+            if (files[i].cacheable && !files[i].cached)
+                storeCache(cache, &files[i].key, files[i].counts.bits);
+    if (code == 0 && report != REPORT_JSON)
+    {
+        // Total number of bits
+        printf("Total bits of everything: %" PRIu64 "\n", total.bits);
+    }
+    if (code == 0 && stats && report != REPORT_JSON)
+        printTextStats(&total);
+    if (code == 0 && report == REPORT_TEXT)
+        printTextReport(argv, files, optind, argc, &run);
+    if (code == 0 && report == REPORT_JSON)
+        printJsonReport(argv, files, optind, argc, &run);
+    if (cache)
+        closeCache(cache);
+    free(files);
+    return code;
+}
+
+// Worker: count the bits in length bytes of a file from offset, send
+// them to the parent and exit. length -1 reads the file to its end.
+void worker(int out, int file, int fd, off_t offset, off_t length)
+{
+    struct result_s result;
+    memset(&result, 0, sizeof(result));
+    result.file = file;
+    uint64_t start_ns = nowNs();
+    if (bitCounter(fd, offset, length, &result.counts) == -1)
+        _exit(3);
+    // The bits are in the histogram
+    if (stats)
+        result.counts.bits = histogramBits(result.counts.histogram, result.counts.positions);
+    result.count_ns = nowNs() - start_ns;
+    // One write of less than PIPE_BUF bytes: the message is never
+    // interleaved with the messages of other workers
+    if (write(out, &result, sizeof(result)) != sizeof(result))
+        _exit(3);
+    // Delete child process
+    _exit(0);
+}
+
+// Bit counter for part of a file, -1 if it can't be read
+// Regular files are mapped and counted in place, or read into a buffer if
+// they can't be mapped or with -i read; pipes, devices and files with
+// -i stream are streamed (length -1)
+int bitCounter(int fd, off_t offset, off_t length, struct counts_s *counts)
+{
+    if (length == 0)
+        return 0;
+    if (length == -1)
+        return streamBitCounter(fd, counts);
+    if (ioPath == IO_MAP && mappedBitCounter(fd, offset, length, counts) == 0)
+        return 0;
+    return readBitCounter(fd, offset, length, counts);
+}
+
+// Bit counter for part of a mapped file, -1 if it can't be mapped
+int mappedBitCounter(int fd, off_t offset, off_t length, struct counts_s *counts)
+{
+    // Mappings start on a page
+    off_t skip = offset % sysconf(_SC_PAGESIZE);
+    uint8_t *data = mmap(NULL, skip + length, PROT_READ, MAP_PRIVATE, fd, offset - skip);
+    if (data == MAP_FAILED)
+        return -1;
+    // Read ahead aggressively and drop pages once they are counted
+    madvise(data, skip + length, MADV_SEQUENTIAL);
+    countBuffer(data + skip, length, counts);
+    munmap(data, skip + length);
+    return 0;
+}
+
+// Bit counter that reads part of a file into a page aligned buffer with
+// pread, -1 if reading fails
+int readBitCounter(int fd, off_t offset, off_t length, struct counts_s *counts)
+{
+    uint8_t *buf;
+    if (posix_memalign((void **)&buf, READ_ALIGN, READ_SIZE) != 0)
+        return -1;
+    int status = 0;
+    // Read a block at a time and let the counting kernel go over all of it
+    while (length != 0)
+    {
+        size_t want = length > READ_SIZE ? READ_SIZE : length;
+        ssize_t len = pread(fd, buf, want, offset);
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len == -1)
+        {
+            perror("read");
+            status = -1;
+            break;
         }
+        // The end of the file, or it got shorter
+        if (len == 0)
+            break;
+        countBuffer(buf, len, counts);
+        offset += len;
+        length -= len;
     }
-    // Total number of bits
-    printf("Total bits of everything: %i\n", total);
+    free(buf);
+    return status;
 }
 
-// Bit counter for a file
-int bitCounter(FILE *fh)
+// Bit counter for a pipe or device read to its end, -1 if reading fails
+// A reader thread fills one buffer while the other is counted, so the
+// counting hides behind the waiting for data
+int streamBitCounter(int fd, struct counts_s *counts)
 {
-    // Total bits collected
-    int bits = 0;
-    int i = fgetc(fh);
-    // Read 1 char at a time. Pass it through intBitCounter to see how many
-    // bits the integer contains and add it total bits
-    while (i != EOF)
+    struct stream_s stream;
+    memset(&stream, 0, sizeof(stream));
+    stream.fd = fd;
+    if (posix_memalign((void **)&stream.bufs[0], READ_ALIGN, 2 * READ_SIZE) != 0)
+        return -1;
+    stream.bufs[1] = stream.bufs[0] + READ_SIZE;
+    pthread_mutex_init(&stream.lock, NULL);
+    pthread_cond_init(&stream.changed, NULL);
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, streamReader, &stream) != 0)
     {
-        int tmp = intBitCounter(i);
-        bits += tmp;
-        i = fgetc(fh);
+        free(stream.bufs[0]);
+        return -1;
     }
-    return bits;
+    ssize_t len;
+    for (int i = 0;; i ^= 1)
+    {
+        pthread_mutex_lock(&stream.lock);
+        while (!stream.full[i])
+            pthread_cond_wait(&stream.changed, &stream.lock);
+        len = stream.lens[i];
+        pthread_mutex_unlock(&stream.lock);
+        if (len <= 0)
+            break;
+        countBuffer(stream.bufs[i], len, counts);
+        // Give the buffer back to the reader
+        pthread_mutex_lock(&stream.lock);
+        stream.full[i] = 0;
+        pthread_cond_signal(&stream.changed);
+        pthread_mutex_unlock(&stream.lock);
+    }
+    // The reader stops after the end of the stream or an error
+    pthread_join(reader, NULL);
+    pthread_cond_destroy(&stream.changed);
+    pthread_mutex_destroy(&stream.lock);
+    free(stream.bufs[0]);
+    return len == -1 ? -1 : 0;
+}
+
+// Reader thread of a stream: fill the buffers in turn until the end of
+// the stream or an error, waiting while the next one is being counted
+void *streamReader(void *arg)
+{
+    struct stream_s *stream = arg;
+    ssize_t len;
+    for (int i = 0;; i ^= 1)
+    {
+        pthread_mutex_lock(&stream->lock);
+        while (stream->full[i])
+            pthread_cond_wait(&stream->changed, &stream->lock);
+        pthread_mutex_unlock(&stream->lock);
+        len = fillBuffer(stream->fd, stream->bufs[i]);
+        pthread_mutex_lock(&stream->lock);
+        stream->lens[i] = len;
+        stream->full[i] = 1;
+        pthread_cond_signal(&stream->changed);
+        pthread_mutex_unlock(&stream->lock);
+        if (len <= 0)
+            return NULL;
+    }
+}
+
+// Read until a buffer of READ_SIZE bytes is full or the stream ends
+// Pipes give at most what the writer has written, often 64K or less;
+// counting in bigger pieces means fewer hand overs between the threads
+ssize_t fillBuffer(int fd, uint8_t *buf)
+{
+    size_t len = 0;
+    while (len < READ_SIZE)
+    {
+        ssize_t got = read(fd, buf + len, READ_SIZE - len);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got == -1)
+        {
+            perror("read");
+            return -1;
+        }
+        if (got == 0)
+            break;
+        len += got;
+    }
+    return len;
+}
+
+// Count a buffer: its bits, or with -s the histogram of its bytes that
+// the bits are worked out from once the worker is done
+void countBuffer(const uint8_t *buf, size_t len, struct counts_s *counts)
+{
+    if (stats)
+        byteHistogram(buf, len, counts->histogram);
+    else
+        counts->bits += countBits(buf, len);
+    counts->bytes += len;
+}
+
+// Add counts of a part to those of a file or of everything
+void addCounts(struct counts_s *to, const struct counts_s *counts)
+{
+    to->bits += counts->bits;
+    to->bytes += counts->bytes;
+    for (int bit = 0; bit < 8; bit++)
+        to->positions[bit] += counts->positions[bit];
+    for (int value = 0; value < 256; value++)
+        to->histogram[value] += counts->histogram[value];
+}
+
+// Throughput in GB/s, 0 if no time passed
+double gbPerSecond(uint64_t bytes, uint64_t ns)
+{
+    return ns ? (double)bytes / ns : 0;
+}
+
+// Report of -r text: a line per file, then the whole run
+void printTextReport(char *names[], struct file_s *files, int first, int last, struct run_s *run)
+{
+    uint64_t bytes = 0;
+    printf("%-32s %14s %14s %7s %10s %8s\n", "file", "bytes", "bits", "chunks", "wall ms", "GB/s");
+    for (int i = first; i < last; i++)
+    {
+        struct file_s *file = &files[i];
+        uint64_t wall_ns = file->end_ns - file->start_ns;
+        printf("%-32s %14" PRIu64 " %14" PRIu64, names[i], file->counts.bytes, file->counts.bits);
+        // Counts from the cache took no time to count
+        if (file->cached)
+            printf(" %7s\n", "cached");
+        else
+            printf(" %7d %10.3f %8.2f\n", file->chunks, wall_ns / 1e6, gbPerSecond(file->counts.bytes, wall_ns));
+        bytes += file->counts.bytes;
+    }
+    printf("all: %" PRIu64 " bytes in %.3f ms, %.2f GB/s with %d workers\n", bytes, run->wall_ns / 1e6,
+           gbPerSecond(bytes, run->wall_ns), run->workers);
+    printf("workers: %.3f ms counting, %.3f ms fork/IPC overhead (%.3f ms in fork)\n", run->count_ns / 1e6,
+           run->overhead_ns / 1e6, run->fork_ns / 1e6);
+}
+
+// Statistics of -s: bits set at each position and the byte histogram,
+// as counts and as shares of the bytes
+void printTextStats(const struct counts_s *counts)
+{
+    double bytes = counts->bytes ? counts->bytes : 1;
+    printf("Bytes: %" PRIu64 "\n", counts->bytes);
+    printf("Bits set at each position, lowest first:\n");
+    for (int bit = 0; bit < 8; bit++)
+        printf("bit %d: %14" PRIu64 " %8.4f%%\n", bit, counts->positions[bit], 100 * counts->positions[bit] / bytes);
+    printf("Bytes of each value:\n");
+    for (int value = 0; value < 256; value++)
+        printf("0x%02x: %12" PRIu64 "%s", value, counts->histogram[value], value % 4 == 3 ? "\n" : "  ");
+}
+
+// Print a string as a JSON string
+void printJsonString(const char *str)
+{
+    putchar('"');
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\')
+            printf("\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            printf("\\u%04x", *str);
+        else
+            putchar(*str);
+    }
+    putchar('"');
+}
+
+// Statistics of -s as JSON members, starting with a comma
+void printJsonStats(const struct counts_s *counts)
+{
+    printf(", \"bit_positions\": [");
+    for (int bit = 0; bit < 8; bit++)
+        printf("%s%" PRIu64, bit ? ", " : "", counts->positions[bit]);
+    printf("], \"byte_histogram\": [");
+    for (int value = 0; value < 256; value++)
+        printf("%s%" PRIu64, value ? ", " : "", counts->histogram[value]);
+    printf("]");
 }
 
-// Counts the number of bits in an integer
-int intBitCounter(int i)
+// Report of -r json: one object with the total, the run and the files,
+// with the statistics of -s for each
+void printJsonReport(char *names[], struct file_s *files, int first, int last, struct run_s *run)
 {
-    int count = 0;
-    while (i)
+    struct counts_s all;
+    memset(&all, 0, sizeof(all));
+    for (int i = first; i < last; i++)
+        addCounts(&all, &files[i].counts);
+    printf("{\"bits\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"wall_ms\": %.3f, \"gb_per_s\": %.3f, ", all.bits,
+           all.bytes, run->wall_ns / 1e6, gbPerSecond(all.bytes, run->wall_ns));
+    printf("\"workers\": %d, \"count_ms\": %.3f, \"overhead_ms\": %.3f, \"fork_ms\": %.3f, \"files\": [",
+           run->workers, run->count_ns / 1e6, run->overhead_ns / 1e6, run->fork_ns / 1e6);
+    for (int i = first; i < last; i++)
     {
-        if (i % 2 == 1)
-            count++;
-        i = i / 2;
+        struct file_s *file = &files[i];
+        uint64_t wall_ns = file->end_ns - file->start_ns;
+        printf("%s\n  {\"name\": ", i == first ? "" : ",");
+        printJsonString(names[i]);
+        printf(", \"bytes\": %" PRIu64 ", \"bits\": %" PRIu64 ", \"chunks\": %d, \"wall_ms\": %.3f, "
+               "\"gb_per_s\": %.3f",
+               file->counts.bytes, file->counts.bits, file->chunks, wall_ns / 1e6,
+               gbPerSecond(file->counts.bytes, wall_ns));
+        if (cache)
+            printf(", \"cached\": %s", file->cached ? "true" : "false");
+        if (stats)
+            printJsonStats(&file->counts);
+        printf("}");
     }
-    return count;
+    printf("\n]");
+    if (stats)
+        printJsonStats(&all);
+    printf("}\n");
 }
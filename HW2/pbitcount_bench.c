@@ -0,0 +1,297 @@
+// pbitcount_bench: generate files from KB to GB, time pbitcount on each
+// with every kernel, I/O path, number of workers and chunk size, check
+// that all of them count the same bits and print a table
+// Build with: gcc -O2 -o pbitcount_bench pbitcount_bench.c popcount.c util.c
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "popcount.h"
+#include "util.h"
+
+// Bytes generated and written at a time
+#define GEN_SIZE (1024 * 1024)
+// Most values a list option takes
+#define MAX_LIST 16
+
+// A comma separated list option, split into its values
+struct list_s
+{
+    char *values[MAX_LIST];
+    int count;
+};
+
+// A generated file and the bits it has, counted while it was written
+struct input_s
+{
+    char name[4096];
+    off_t size;
+    uint64_t bits;
+};
+
+void printUsage(void);
+int splitList(char *arg, struct list_s *list);
+int generateFile(struct input_s *input, const char *dir, const char *size, uint64_t seed);
+void autoChunk(char *chunk, size_t len, off_t size, const char *jobs);
+int64_t runPbitcount(const char *path, const char *kernel, const char *io, const char *jobs, const char *chunk,
+                     const char *file, uint64_t *bits);
+
+int main(int argc, char *argv[])
+{
+    const char *path = "./pbitcount";
+    const char *dir = "/tmp";
+    char sizes[] = "4K,1M,64M,1G";
+    char ios[] = "map,read,stream";
+    char chunks[] = "auto";
+    char jobsArg[32];
+    char kernelsArg[256] = "";
+    int runs = 3;
+    int keep = 0;
+    struct list_s sizeList, ioList, jobsList, kernelList, chunkList;
+    memset(&sizeList, 0, sizeof(sizeList));
+    memset(&chunkList, 0, sizeof(chunkList));
+    memset(&ioList, 0, sizeof(ioList));
+    memset(&jobsList, 0, sizeof(jobsList));
+    memset(&kernelList, 0, sizeof(kernelList));
+    // One worker and one per core, every kernel this CPU runs
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > 1)
+        snprintf(jobsArg, sizeof(jobsArg), "1,%ld", cores);
+    else
+        strcpy(jobsArg, "1");
+    for (const struct popcount_kernel_s *kernel = popcountKernels; kernel->name; kernel++)
+        if (kernel->supported())
+        {
+            if (*kernelsArg)
+                strcat(kernelsArg, ",");
+            strcat(kernelsArg, kernel->name);
+        }
+    int ok = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:d:s:k:i:j:c:n:K")) != -1)
+    {
+        if (opt == 'p')
+            path = optarg;
+        else if (opt == 'd')
+            dir = optarg;
+        else if (opt == 's')
+            ok &= splitList(optarg, &sizeList);
+        else if (opt == 'k')
+            ok &= splitList(optarg, &kernelList);
+        else if (opt == 'i')
+            ok &= splitList(optarg, &ioList);
+        else if (opt == 'j')
+            ok &= splitList(optarg, &jobsList);
+        else if (opt == 'c')
+            ok &= splitList(optarg, &chunkList);
+        else if (opt == 'n')
+            runs = atoi(optarg);
+        else if (opt == 'K')
+            keep = 1;
+        else
+            ok = 0;
+    }
+    // Lists not given on the command line
+    if (sizeList.count == 0)
+        ok &= splitList(sizes, &sizeList);
+    if (kernelList.count == 0)
+        ok &= splitList(kernelsArg, &kernelList);
+    if (ioList.count == 0)
+        ok &= splitList(ios, &ioList);
+    if (jobsList.count == 0)
+        ok &= splitList(jobsArg, &jobsList);
+    if (chunkList.count == 0)
+        ok &= splitList(chunks, &chunkList);
+    for (int i = 0; i < sizeList.count; i++)
+        ok &= parseSize(sizeList.values[i]) >= 0;
+    for (int i = 0; i < jobsList.count; i++)
+        ok &= atoi(jobsList.values[i]) >= 1;
+    for (int i = 0; i < chunkList.count; i++)
+        ok &= strcmp(chunkList.values[i], "auto") == 0 || parseSize(chunkList.values[i]) >= 1;
+    if (!ok || optind != argc || runs < 1)
+    {
+        printUsage();
+        return 1;
+    }
+
+    struct input_s *inputs = calloc(sizeList.count, sizeof(struct input_s));
+    for (int i = 0; i < sizeList.count; i++)
+    {
+        if (generateFile(&inputs[i], dir, sizeList.values[i], i + 1) == -1)
+        {
+            perror(inputs[i].name);
+            return 2;
+        }
+    }
+    int mismatches = 0;
+    printf("%-8s %-8s %-7s %5s %10s %10s %8s  %s\n", "size", "kernel", "io", "jobs", "chunk", "best ms", "GB/s",
+           "bits");
+    for (int i = 0; i < sizeList.count; i++)
+    {
+        struct input_s *input = &inputs[i];
+        // A first run that isn't timed brings the file into the page cache
+        uint64_t bits;
+        char chunk[32];
+        autoChunk(chunk, sizeof(chunk), input->size, "1");
+        runPbitcount(path, kernelList.values[0], ioList.values[0], "1", chunk, input->name, &bits);
+        for (int k = 0; k < kernelList.count; k++)
+            for (int o = 0; o < ioList.count; o++)
+                for (int j = 0; j < jobsList.count; j++)
+                    for (int c = 0; c < chunkList.count; c++)
+                    {
+                        if (strcmp(chunkList.values[c], "auto") == 0)
+                            autoChunk(chunk, sizeof(chunk), input->size, jobsList.values[j]);
+                        else
+                            snprintf(chunk, sizeof(chunk), "%s", chunkList.values[c]);
+                        int64_t best = -1;
+                        int agree = 1;
+                        for (int run = 0; run < runs; run++)
+                        {
+                            int64_t ns = runPbitcount(path, kernelList.values[k], ioList.values[o],
+                                                      jobsList.values[j], chunk, input->name, &bits);
+                            if (ns == -1 || bits != input->bits)
+                                agree = 0;
+                            else if (best == -1 || ns < best)
+                                best = ns;
+                        }
+                        printf("%-8s %-8s %-7s %5s %10s ", sizeList.values[i], kernelList.values[k],
+                               ioList.values[o], jobsList.values[j], chunk);
+                        if (agree)
+                            printf("%10.3f %8.2f  ok\n", best / 1e6, best ? (double)input->size / best : 0);
+                        else
+                        {
+                            printf("%10s %8s  MISMATCH, expected %" PRIu64 "\n", "-", "-", input->bits);
+                            mismatches++;
+                        }
+                        fflush(stdout);
+                    }
+    }
+    if (!keep)
+        for (int i = 0; i < sizeList.count; i++)
+            unlink(inputs[i].name);
+    free(inputs);
+    if (mismatches)
+    {
+        printf("%d combinations failed or counted other bits\n", mismatches);
+        return 4;
+    }
+    printf("All combinations counted the same bits\n");
+    return 0;
+}
+
+void printUsage(void)
+{
+    printf("USAGE: ./pbitcount_bench [options]\n");
+    printf("  -p path        pbitcount to run (./pbitcount)\n");
+    printf("  -d dir         where the input files are made (/tmp)\n");
+    printf("  -s sizes       sizes of the input files, with K, M or G (4K,1M,64M,1G)\n");
+    printf("  -k kernels     counting kernels (all this CPU can run)\n");
+    printf("  -i ios         I/O paths (map,read,stream)\n");
+    printf("  -j jobs        numbers of workers (1 and the number of cores)\n");
+    printf("  -c chunks      chunk sizes, with K, M or G; auto splits each file\n");
+    printf("                 evenly between the workers (auto)\n");
+    printf("  -n runs        runs of each combination, the fastest is shown (3)\n");
+    printf("  -K             keep the input files\n");
+    printf("Times are with the files in the page cache, from fork to exit.\n");
+}
+
+// Split a comma separated list in place, 0 if it is empty or too long
+int splitList(char *arg, struct list_s *list)
+{
+    list->count = 0;
+    for (char *value = strtok(arg, ","); value; value = strtok(NULL, ","))
+    {
+        if (list->count == MAX_LIST)
+            return 0;
+        list->values[list->count++] = value;
+    }
+    return list->count > 0;
+}
+
+// The chunk size that splits a file evenly between a number of workers,
+// so that every worker counts a part of it however small the file is
+void autoChunk(char *chunk, size_t len, off_t size, const char *jobs)
+{
+    off_t workers = atoi(jobs);
+    off_t bytes = (size + workers - 1) / workers;
+    snprintf(chunk, len, "%lld", (long long)(bytes > 0 ? bytes : 1));
+}
+
+// Write a file of random bytes and count its bits with the plain kernel
+// on the way, so the count doesn't depend on the kernels being compared.
+// -1 if the file can't be written.
+int generateFile(struct input_s *input, const char *dir, const char *size, uint64_t seed)
+{
+    snprintf(input->name, sizeof(input->name), "%s/pbitcount_bench_%s.dat", dir, size);
+    input->size = parseSize(size);
+    input->bits = 0;
+    popcount_f count = findPopcount("scalar");
+    FILE *fh = fopen(input->name, "wb");
+    if (!fh)
+        return -1;
+    uint64_t *buf = malloc(GEN_SIZE);
+    // xorshift64, different for each file
+    uint64_t state = 0x9E3779B97F4A7C15ULL * seed;
+    for (off_t left = input->size; left > 0;)
+    {
+        size_t len = left < GEN_SIZE ? left : GEN_SIZE;
+        for (size_t i = 0; i < GEN_SIZE / sizeof(uint64_t); i++)
+        {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            buf[i] = state;
+        }
+        input->bits += count((uint8_t *)buf, len);
+        if (fwrite(buf, 1, len, fh) != len)
+        {
+            fclose(fh);
+            free(buf);
+            return -1;
+        }
+        left -= len;
+    }
+    free(buf);
+    return fclose(fh) == 0 ? 0 : -1;
+}
+
+// Run pbitcount on a file and read the bits it counted; the time from
+// fork until it exited in ns, or -1 if it failed
+int64_t runPbitcount(const char *path, const char *kernel, const char *io, const char *jobs, const char *chunk,
+                     const char *file, uint64_t *bits)
+{
+    int fds[2];
+    if (pipe(fds) == -1)
+        return -1;
+    uint64_t start = nowNs();
+    pid_t pid = fork();
+    if (pid == -1)
+        return -1;
+    if (pid == 0)
+    {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl(path, path, "-k", kernel, "-i", io, "-j", jobs, "-c", chunk, file, (char *)NULL);
+        perror(path);
+        _exit(127);
+    }
+    close(fds[1]);
+    char out[4096];
+    size_t len = 0;
+    ssize_t got;
+    while ((got = read(fds[0], out + len, sizeof(out) - 1 - len)) > 0)
+        len += got;
+    out[len] = '\0';
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    uint64_t ns = nowNs() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    if (sscanf(out, "Total bits of everything: %" SCNu64, bits) != 1)
+        return -1;
+    return ns;
+}
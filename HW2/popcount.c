@@ -0,0 +1,190 @@
+#include <string.h>
+#include "popcount.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86 1
+#endif
+
+// Portable kernels
+
+// Counts the bits of a 64 bit word without any special instruction
+static uint64_t wordBitCounter(uint64_t x)
+{
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (x * 0x0101010101010101ULL) >> 56;
+}
+
+// Counts 8 bytes at a time with wordBitCounter, then the bytes left over
+static uint64_t scalarCount(const uint8_t *buf, size_t len)
+{
+    uint64_t bits = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, buf + i, 8);
+        bits += wordBitCounter(word);
+    }
+    uint64_t rest = 0;
+    memcpy(&rest, buf + i, len - i);
+    return bits + wordBitCounter(rest);
+}
+
+static int alwaysSupported(void)
+{
+    return 1;
+}
+
+#ifdef X86
+
+// Same as scalarCount with the popcnt instruction
+__attribute__((target("popcnt"))) static uint64_t popcntCount(const uint8_t *buf, size_t len)
+{
+    uint64_t bits = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, buf + i, 8);
+        bits += __builtin_popcountll(word);
+    }
+    uint64_t rest = 0;
+    memcpy(&rest, buf + i, len - i);
+    return bits + __builtin_popcountll(rest);
+}
+
+static int popcntSupported(void)
+{
+    return __builtin_cpu_supports("popcnt");
+}
+
+// Counts 32 bytes at a time: each nibble looks up its count in a table
+// with vpshufb. The byte counts are added up in 8 bit lanes for up to 31
+// blocks (31 * 8 < 256), then summed into 64 bit lanes with vpsadbw.
+__attribute__((target("avx2"))) static uint64_t avx2Count(const uint8_t *buf, size_t len)
+{
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+    while (i + 32 <= len)
+    {
+        __m256i bytes = _mm256_setzero_si256();
+        for (int block = 0; block < 31 && i + 32 <= len; block++, i += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+            __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, low));
+            __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+            bytes = _mm256_add_epi8(bytes, _mm256_add_epi8(lo, hi));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+    }
+    uint64_t bits = (uint64_t)_mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+                    _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+    return bits + popcntCount(buf + i, len - i);
+}
+
+static int avx2Supported(void)
+{
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+}
+
+// Counts 64 bytes at a time with vpopcntq, in 4 independent sums so the
+// adds don't wait for each other. The tail is loaded with a byte mask.
+__attribute__((target("avx512f,avx512bw,avx512vpopcntdq"))) static uint64_t avx512Count(const uint8_t *buf,
+                                                                                      size_t len)
+{
+    __m512i sums[4] = {_mm512_setzero_si512(), _mm512_setzero_si512(), _mm512_setzero_si512(),
+                       _mm512_setzero_si512()};
+    size_t i = 0;
+    for (; i + 256 <= len; i += 256)
+        for (int j = 0; j < 4; j++)
+            sums[j] = _mm512_add_epi64(sums[j], _mm512_popcnt_epi64(_mm512_loadu_si512(buf + i + 64 * j)));
+    for (; i < len; i += 64)
+    {
+        __mmask64 mask = len - i >= 64 ? ~0ULL : (1ULL << (len - i)) - 1;
+        sums[0] = _mm512_add_epi64(sums[0], _mm512_popcnt_epi64(_mm512_maskz_loadu_epi8(mask, buf + i)));
+    }
+    __m512i sum = _mm512_add_epi64(_mm512_add_epi64(sums[0], sums[1]), _mm512_add_epi64(sums[2], sums[3]));
+    return _mm512_reduce_add_epi64(sum);
+}
+
+static int avx512Supported(void)
+{
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+           __builtin_cpu_supports("avx512vpopcntdq");
+}
+
+#endif
+
+const struct popcount_kernel_s popcountKernels[] = {
+#ifdef X86
+    {"avx512", avx512Count, avx512Supported},
+    {"avx2", avx2Count, avx2Supported},
+    {"popcnt", popcntCount, popcntSupported},
+#endif
+    {"scalar", scalarCount, alwaysSupported},
+    {NULL, NULL, NULL},
+};
+
+// The fastest kernel this CPU supports
+popcount_f pickPopcount(void)
+{
+    const struct popcount_kernel_s *kernel = popcountKernels;
+    while (!kernel->supported())
+        kernel++;
+    return kernel->count;
+}
+
+// The kernel with this name, or NULL if there is none or the CPU can't run it
+popcount_f findPopcount(const char *name)
+{
+    for (const struct popcount_kernel_s *kernel = popcountKernels; kernel->name; kernel++)
+        if (strcmp(kernel->name, name) == 0)
+            return kernel->supported() ? kernel->count : NULL;
+    return NULL;
+}
+
+// Statistics
+
+// Reads 8 bytes at a time and spreads them over 4 tables, so that adding
+// to the count of a value doesn't wait for the last add to the same one
+void byteHistogram(const uint8_t *buf, size_t len, uint64_t histogram[256])
+{
+    uint64_t tables[4][256];
+    memset(tables, 0, sizeof(tables));
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, buf + i, 8);
+        tables[0][word & 0xFF]++;
+        tables[1][(word >> 8) & 0xFF]++;
+        tables[2][(word >> 16) & 0xFF]++;
+        tables[3][(word >> 24) & 0xFF]++;
+        tables[0][(word >> 32) & 0xFF]++;
+        tables[1][(word >> 40) & 0xFF]++;
+        tables[2][(word >> 48) & 0xFF]++;
+        tables[3][word >> 56]++;
+    }
+    for (; i < len; i++)
+        tables[0][buf[i]]++;
+    for (int value = 0; value < 256; value++)
+        histogram[value] += tables[0][value] + tables[1][value] + tables[2][value] + tables[3][value];
+}
+
+uint64_t histogramBits(const uint64_t histogram[256], uint64_t positions[8])
+{
+    uint64_t bits = 0;
+    for (int value = 0; value < 256; value++)
+    {
+        bits += histogram[value] * __builtin_popcount(value);
+        for (int bit = 0; bit < 8; bit++)
+            if (value & (1 << bit))
+                positions[bit] += histogram[value];
+    }
+    return bits;
+}
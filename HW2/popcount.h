@@ -0,0 +1,27 @@
+#include <stddef.h>
+#include <stdint.h>
+#pragma once
+
+// Counts the set bits in len bytes starting at buf
+typedef uint64_t (*popcount_f)(const uint8_t *buf, size_t len);
+
+// A counting kernel and whether this CPU can run it
+struct popcount_kernel_s
+{
+    const char *name;
+    popcount_f count;
+    int (*supported)(void);
+};
+
+// Kernels from fastest to slowest, ending with an entry whose name is NULL
+extern const struct popcount_kernel_s popcountKernels[];
+
+// The fastest kernel this CPU supports
+popcount_f pickPopcount(void);
+// The kernel with this name, or NULL if there is none or the CPU can't run it
+popcount_f findPopcount(const char *name);
+
+// Adds how often each byte value occurs in len bytes starting at buf
+void byteHistogram(const uint8_t *buf, size_t len, uint64_t histogram[256]);
+// Set bits in total and at each bit position of the bytes of a histogram
+uint64_t histogramBits(const uint64_t histogram[256], uint64_t positions[8]);
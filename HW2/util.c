@@ -0,0 +1,29 @@
+#include <stdlib.h>
+#include <time.h>
+#include "util.h"
+
+// Parse a size with an optional K, M or G suffix, -1 if it isn't one
+off_t parseSize(const char *arg)
+{
+    char *end;
+    long long size = strtoll(arg, &end, 10);
+    if (*end == 'K' || *end == 'k')
+        size <<= 10;
+    else if (*end == 'M' || *end == 'm')
+        size <<= 20;
+    else if (*end == 'G' || *end == 'g')
+        size <<= 30;
+    else if (*end)
+        return -1;
+    if (*end && end[1])
+        return -1;
+    return size;
+}
+
+// The current time in ns; the clock is the same in every process
+uint64_t nowNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
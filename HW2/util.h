@@ -0,0 +1,8 @@
+#include <stdint.h>
+#include <sys/types.h>
+#pragma once
+
+// Parse a size with an optional K, M or G suffix, -1 if it isn't one
+off_t parseSize(const char *arg);
+// The current time in ns; the clock is the same in every process
+uint64_t nowNs(void);
@@ -1,384 +1,802 @@
 #include <string.h>
-#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
 #include <unistd.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <netinet/in.h>
-#include "bigbag.h"
+#include <pthread.h>
+#include "libbigbag.h"
+#include "libbigbag_shards.h"
+#include "bigbag_proto.h"
 
 /**
- * Return the entry at a offset
+ * Print the error message when an invalid input is entered.
+ * @param {char} c - message that was entered
 **/
-struct bigbag_entry_s *entry_addr(void *hdr, uint32_t offset)
+void printCommands(char *c)
 {
-    if (offset == 0)
-        return NULL;
-    return (struct bigbag_entry_s *)((char *)hdr + offset);
+    printf("%c not used correctly\n", c[0]);
+    printf("possible commands:\n");
+    printf("a string_to_add\n");
+    printf("d string_to_delete\n");
+    printf("c string_to_check\n");
+    printf("b file_of_strings_to_add\n");
+    printf("p prefix_to_list\n");
+    printf("r first_to_list last_to_list\n");
+    printf("l\n");
+    printf("s file_to_save_a_snapshot_to (not with -S)\n");
 }
 
 /**
- * Return the offset of an entry
+ * Print the statistics of a bag on one line.
+ *
+ * @param {char} label - printed in front of the statistics
+ * @param {bigbag_stats_s} stats - statistics to print
 **/
-uint32_t entry_offset(void *hdr, void *entry)
+void printStats(char *label, struct bigbag_stats_s *stats)
 {
-    return (uint32_t)((uint64_t)entry - (uint64_t)hdr);
+    double fragmentation = 0;
+    double scattered = 0;
+    if (stats->free_bytes)
+        fragmentation = 100.0 * (stats->free_bytes - stats->largest_free) / stats->free_bytes;
+    if (stats->elements > 1)
+        scattered = 100.0 * stats->scattered_links / (stats->elements - 1);
+    printf("%s: %u elements in %lu bytes, %lu bytes free in %u entries (largest %u), "
+           "%.1f%% fragmented, %.1f%% of links out of order\n",
+           label, stats->elements, stats->used_bytes, stats->free_bytes, stats->free_entries,
+           stats->largest_free, fragmentation, scattered);
 }
 
 /**
- * Print the error message when an invalid input is entered.
- * @param {char} c - message that was entered
+ * Visitor for listElements and listRange: print the element and count it.
 **/
-void printCommands(char *c)
+bool printElement(const char *element, void *arg)
 {
-    printf("%c not used correctly\n", c[0]);
-    printf("possible commands:\n");
-    printf("a string_to_add\n");
-    printf("d string_to_delete\n");
-    printf("c string_to_check\n");
-    printf("l\n");
+    (*(uint32_t *)arg)++;
+    printf("%s\n", element);
+    return true;
 }
 
 /**
- * List all elements in the file. 
- * Method:
- * 1. Fetch first entry from hdr->first_element
- * 2. If entry doesn't exist - bag is empty
- * 3. Iterate through the linked list of entries
- *  - Print each entry
- *  - Fetch next entry
- *  - Exit if the next offset is 0 (reached the end)
- * 
- * @param {bigbag_hdr_s} hdr - header of the file
+ * List all elements in the file, in sorted order.
+ * Commands take either a bag or, with -S, a sharded store.
+ *
+ * @param {bigbag_s} bag - the open bag, or NULL
+ * @param {bigbag_shards_s} store - the open store, or NULL
 **/
-void listElements(struct bigbag_hdr_s *hdr)
+void listElements(struct bigbag_s *bag, struct bigbag_shards_s *store)
 {
-    struct bigbag_entry_s *entry;
-    uint32_t first_element = hdr->first_element;
-    // fetch first entry
-    entry = entry_addr(hdr, first_element);
-    if (!entry)
-    {
+    uint32_t count = 0;
+    int status = store ? bigbag_shards_foreach(store, printElement, &count)
+                       : bigbag_foreach(bag, printElement, &count);
+    if (status != BIGBAG_OK)
+        printf("%s\n", bigbag_strerror(status));
+    else if (count == 0)
         printf("empty bag\n");
-        return;
+}
+
+/**
+ * List the elements of a range, or the elements starting with a prefix.
+ * The range is given as "first last"; both ends are included.
+ *
+ * @param {bigbag_s} bag - the open bag, or NULL
+ * @param {bigbag_shards_s} store - the open store, or NULL
+ * @param {char} command - 'r' for a range, 'p' for a prefix
+ * @param {char} args - the range or the prefix
+**/
+void listRange(struct bigbag_s *bag, struct bigbag_shards_s *store, char command, char *args)
+{
+    uint32_t count = 0;
+    int status;
+    if (command == 'p')
+    {
+        status = store ? bigbag_shards_prefix(store, args, printElement, &count)
+                       : bigbag_prefix(bag, args, printElement, &count);
     }
-    while (entry)
+    else
     {
-        printf("%s\n", entry->str);
-        // fetch next entry
-        unsigned int nextOffset = entry->next;
-        if (nextOffset == 0)
+        char *hi = strchr(args, ' ');
+        if (!hi)
+        {
+            printCommands("r");
             return;
-        entry = entry_addr(hdr, nextOffset);
+        }
+        *hi++ = 0;
+        status = store ? bigbag_shards_range(store, args, hi, printElement, &count)
+                       : bigbag_range(bag, args, hi, printElement, &count);
     }
+    if (status != BIGBAG_OK)
+        printf("%s\n", bigbag_strerror(status));
+    else if (count == 0)
+        printf("no matches\n");
 }
 
 /**
- * Add an element to the file. 
- * Method:
- * 1. Create a new entry in the file from the free space
- *  - If the entry exceeds the amount of free space, the bag is full
- * 2. Traverse the linked list with 2 runners front and back
- *  - Corner case #1: Bag is empty
- *  - Corner case #2: Element should be inserted at the first position
- *  - Corner case #3: There is a string that matches the element
- *  - Corner case #4: Element should be inserted at the last position
- *  - Note: My if statement covers corner case #3
- * 3. Set the pointer of back to the new entry
- * 4. Set the new entry next to front's offset
- * 
- * 
- * @param {bigbag_hdr_s} hdr - header of the file
- * @param {char} element - element to add to file
+ * Run a command that takes an element: a, b, d or c.
+ * Returns its status; printResult prints it.
+ *
+ * @param {bigbag_s} bag - the open bag, or NULL
+ * @param {bigbag_shards_s} store - the open store, or NULL
+ * @param {char} command - the command
+ * @param {char} element - element, or file for b
+ * @param {uint32_t} count - receives the number of elements added by b
+**/
+int runCommand(struct bigbag_s *bag, struct bigbag_shards_s *store, char command, char *element, uint32_t *count)
+{
+    if (command == 'a')
+        return store ? bigbag_shards_add(store, element) : bigbag_add(bag, element);
+    if (command == 'b')
+        return store ? bigbag_shards_add_file(store, element, count) : bigbag_add_file(bag, element, count);
+    if (command == 'd')
+        return store ? bigbag_shards_delete(store, element) : bigbag_delete(bag, element);
+    return store ? bigbag_shards_check(store, element) : bigbag_check(bag, element);
+}
+
+/**
+ * Print the response to a command run by runCommand.
+ *
+ * @param {char} command - the command
+ * @param {char} element - element, or file for b
+ * @param {int} status - what the command returned
+ * @param {uint32_t} count - number of elements added by b
+**/
+void printResult(char command, char *element, int status, uint32_t count)
+{
+    if (command == 'a' && status == BIGBAG_OK)
+        printf("added %s\n", element);
+    else if (command == 'b' && status == BIGBAG_OK)
+        printf("added %u from %s\n", count, element);
+    else if (command == 'd' && status == BIGBAG_OK)
+        printf("deleted %s\n", element);
+    else if (command == 'd' && status == BIGBAG_ERR_NOT_FOUND)
+        printf("no %s\n", element);
+    else if (command == 'c' && status == BIGBAG_OK)
+        printf("found\n");
+    else if (command == 'c' && status == BIGBAG_ERR_NOT_FOUND)
+        printf("not found\n");
+    else if (status == BIGBAG_ERR_FULL)
+        printf("out of space\n");
+    // the caller stops on a failed commit
+    else if (status != BIGBAG_OK && status != BIGBAG_ERR_COMMIT)
+        printf("%s: %s\n", element, bigbag_strerror(status));
+}
+
+/**
+ * Compact a bag file and print its statistics before and after.
+ *
+ * @param {char} filename - bag to compact
 **/
-void addElement(struct bigbag_hdr_s *hdr, char *element)
+int compactBag(char *filename)
 {
-    struct bigbag_entry_s *newEntry;
-    struct bigbag_entry_s *front;
-    struct bigbag_entry_s *back;
-    uint32_t first_element = hdr->first_element;
-    uint32_t first_free = hdr->first_free;
-    uint32_t element_entry_size = MIN_ENTRY_SIZE + strlen(element) + 1;
-    front = entry_addr(hdr, first_free);
-    uint32_t old_length = front->entry_len;
-    // if there is enough free space
-    if (front->entry_len >= element_entry_size)
+    struct bigbag_stats_s before, after;
+    int status = bigbag_compact(filename, &before, &after);
+    if (status == BIGBAG_ERR_FULL)
     {
-        newEntry = entry_addr(hdr, hdr->first_free);
-        newEntry->next = 0;
-        strcpy(newEntry->str, element);
-        newEntry->entry_len = strlen(element) + 1;
-        newEntry->entry_magic = BIGBAG_USED_ENTRY_MAGIC;
-        // Remove element size
-        uint32_t new_first_free = first_free + sizeof(newEntry) + strlen(element) + 1;
-        front = entry_addr(hdr, new_first_free);
-        front->entry_magic = BIGBAG_FREE_ENTRY_MAGIC;
-        front->entry_len = old_length - element_entry_size;
-        // Change offset
-        hdr->first_free = new_first_free;
+        printf("%s is too big to compact\n", filename);
+        return 5;
     }
-    else
+    if (status != BIGBAG_OK)
     {
-        printf("out of space\n");
-        return;
+        printf("%s: %s\n", filename, bigbag_strerror(status));
+        return status == BIGBAG_ERR_FORMAT ? 4 : 2;
+    }
+    printStats("before", &before);
+    printStats("after", &after);
+    return 0;
+}
+
+/**
+ * Build a new bag from a file and print its statistics.
+ *
+ * @param {char} input - file with one element per line
+ * @param {char} filename - bag to build
+**/
+int buildBag(char *input, char *filename)
+{
+    if (access(input, R_OK) == -1)
+    {
+        perror(input);
+        return 2;
+    }
+    uint32_t count;
+    int status = bigbag_build(filename, input, &count);
+    if (status == BIGBAG_ERR_FULL)
+    {
+        printf("%s doesn't fit in a bag\n", input);
+        return 5;
+    }
+    if (status != BIGBAG_OK)
+    {
+        printf("%s: %s\n", filename, bigbag_strerror(status));
+        return 2;
+    }
+    printf("%u elements\n", count);
+    return 0;
+}
+
+/**
+ * Run the text commands from stdin until it ends.
+ * Returns the exit code of the program.
+ *
+ * @param {bigbag_s} bag - the open bag
+**/
+int serveText(struct bigbag_s *bag)
+{
+    char *buffer = NULL;
+    size_t bufsize = 0;
+    ssize_t len;
+    // Command line interface
+    while ((len = getline(&buffer, &bufsize, stdin)) != -1)
+    {
+        // Remove line break
+        if (len > 0 && buffer[len - 1] == '\n')
+            buffer[--len] = 0;
+
+        // Element to be added/deleted/checked, after the command and a space
+        char *element = buffer + (len > 2 ? 2 : len);
+
+        int status = BIGBAG_OK;
+        // List
+        if (buffer[0] == 'l')
+        {
+            listElements(bag, NULL);
+        }
+        // Prefix or range
+        else if (buffer[0] == 'p' || buffer[0] == 'r')
+        {
+            listRange(bag, NULL, buffer[0], element);
+        }
+        // Save a snapshot
+        else if (buffer[0] == 's' && *element)
+        {
+            status = bigbag_save(bag, element);
+            if (status == BIGBAG_OK)
+                printf("saved to %s\n", element);
+            else
+                printf("%s: %s\n", element, bigbag_strerror(status));
+        }
+        // Add, bulk add, delete or check
+        else if (buffer[0] && strchr("abdc", buffer[0]))
+        {
+            uint32_t count = 0;
+            status = runCommand(bag, NULL, buffer[0], element, &count);
+            printResult(buffer[0], element, status, count);
+        }
+        // Invalid command
+        else
+        {
+            printCommands(buffer);
+        }
+        // A durable bag that can't commit has lost track of the file
+        if (status == BIGBAG_ERR_COMMIT)
+        {
+            fprintf(stderr, "commit: %s\n", bigbag_strerror(status));
+            free(buffer);
+            return 5;
+        }
+    }
+    // Free buffer space
+    free(buffer);
+    return 0;
+}
+
+/**
+ * Responses of the binary protocol, written to stdout in one go.
+**/
+struct out_buf_s
+{
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/**
+ * Make room for len more bytes of output and return where they go.
+**/
+char *appendOut(struct out_buf_s *out, size_t len)
+{
+    if (out->len + len > out->cap)
+    {
+        out->cap = (out->len + len) * 2;
+        out->data = realloc(out->data, out->cap);
+    }
+    out->len += len;
+    return out->data + out->len - len;
+}
+
+/**
+ * Visitor for binary list requests: append the element and its terminator.
+**/
+bool appendElement(const char *element, void *arg)
+{
+    size_t len = strlen(element) + 1;
+    memcpy(appendOut(arg, len), element, len);
+    return true;
+}
+
+/**
+ * Run one binary request and append its response to out.
+ * Returns the status of the response.
+ *
+ * @param {bigbag_s} bag - the open bag
+ * @param {uint8_t} op - command of the request
+ * @param {char} payload - payload of the request
+ * @param {uint32_t} len - bytes in payload
+ * @param {out_buf_s} out - receives the response
+**/
+int serveRequest(struct bigbag_s *bag, uint8_t op, char *payload, uint32_t len, struct out_buf_s *out)
+{
+    // the header goes in front once the length of the payload is known
+    size_t at = out->len;
+    appendOut(out, sizeof(struct bigbag_response_s));
+    bool terminated = len > 0 && payload[len - 1] == 0;
+    char *hi = terminated ? (char *)memchr(payload, 0, len) + 1 : NULL;
+    uint32_t count;
+    int status;
+    if (op == 'l')
+        status = bigbag_foreach(bag, appendElement, out);
+    else if (!terminated)
+        status = BIGBAG_ERR_REQUEST;
+    else if (op == 'a')
+        status = bigbag_add(bag, payload);
+    else if (op == 'd')
+        status = bigbag_delete(bag, payload);
+    else if (op == 'c')
+        status = bigbag_check(bag, payload);
+    else if (op == 'p')
+        status = bigbag_prefix(bag, payload, appendElement, out);
+    else if (op == 'r' && hi < payload + len)
+        status = bigbag_range(bag, payload, hi, appendElement, out);
+    else if (op == 's')
+        status = bigbag_save(bag, payload);
+    else if (op == 'b')
+    {
+        status = bigbag_add_file(bag, payload, &count);
+        if (status == BIGBAG_OK)
+            memcpy(appendOut(out, sizeof(count)), &count, sizeof(count));
     }
-    front = entry_addr(hdr, first_element);
-    back = front;
-    // Resolves corner case #1: Empty bag
-    if (!front)
+    else
+        status = BIGBAG_ERR_REQUEST;
+    // a failed listing may have left some elements behind
+    if (status != BIGBAG_OK)
+        out->len = at + sizeof(struct bigbag_response_s);
+    struct bigbag_response_s response = {status, out->len - at - sizeof(response)};
+    memcpy(out->data + at, &response, sizeof(response));
+    return status;
+}
+
+/**
+ * Write a whole buffer, retrying short writes.
+**/
+bool writeAll(int fd, char *data, size_t len)
+{
+    while (len)
     {
-        newEntry->next = hdr->first_element;
-        hdr->first_element = first_free;
+        ssize_t n = write(fd, data, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return false;
+        data += n;
+        len -= n;
     }
+    return true;
+}
 
-    while (front)
+/**
+ * Run binary requests from stdin until it ends (see bigbag_proto.h).
+ * Method:
+ * 1. Read as much as stdin has into the input buffer
+ * 2. Run every complete request in it, collecting the responses
+ * 3. Write all responses with one write before waiting for more input
+ * 4. Keep a partial request at the front of the buffer for the next read
+ *
+ * Returns the exit code of the program.
+ *
+ * @param {bigbag_s} bag - the open bag
+**/
+int serveBinary(struct bigbag_s *bag)
+{
+    size_t cap = 64 * 1024;
+    char *in = malloc(cap);
+    size_t start = 0;
+    size_t end = 0;
+    struct out_buf_s out = {NULL, 0, 0};
+    int code = -1;
+    while (code == -1)
     {
-        // element <= front
-        if (strcmp(element, front->str) <= 0)
+        struct bigbag_request_s request;
+        while (code == -1 && end - start >= sizeof(request))
         {
-            // Check if this is first element
-            // Corner case #2: Element should be inserted at the first position
-            if (back == front)
+            memcpy(&request, in + start, sizeof(request));
+            if (request.len > BIGBAG_MAX_REQUEST_LEN)
             {
-                newEntry->next = hdr->first_element;
-                hdr->first_element = first_free;
+                // can't skip what won't fit: answer and stop
+                struct bigbag_response_s response = {BIGBAG_ERR_REQUEST, 0};
+                memcpy(appendOut(&out, sizeof(response)), &response, sizeof(response));
+                code = 1;
+                break;
             }
-            else
+            if (end - start < sizeof(request) + request.len)
+                break;
+            char *payload = in + start + sizeof(request);
+            start += sizeof(request) + request.len;
+            int status = serveRequest(bag, request.op, payload, request.len, &out);
+            // A durable bag that can't commit has lost track of the file
+            if (status == BIGBAG_ERR_COMMIT)
             {
-                // Set new element next to front
-                newEntry->next = back->next;
-                // Should point to newly inserted element
-                back->next = first_free;
+                fprintf(stderr, "commit: %s\n", bigbag_strerror(status));
+                code = 5;
             }
-            break;
         }
-        // Fetch next entry
-        unsigned int nextOffset = front->next;
-        back = front;
-        front = entry_addr(hdr, nextOffset);
-        // Resolves corner case #4: Element is last position
-        if (!front)
+        if (out.len && !writeAll(STDOUT_FILENO, out.data, out.len))
         {
-            newEntry->next = 0;
-            back->next = first_free;
+            perror("write");
+            code = 2;
+        }
+        out.len = 0;
+        if (code != -1)
             break;
+
+        // keep the partial request and make room for the rest of it
+        memmove(in, in + start, end - start);
+        end -= start;
+        start = 0;
+        if (end >= sizeof(request))
+            memcpy(&request, in, sizeof(request));
+        if (end >= sizeof(request) && sizeof(request) + request.len > cap)
+        {
+            cap = sizeof(request) + request.len;
+            in = realloc(in, cap);
+        }
+        ssize_t n = read(STDIN_FILENO, in + end, cap - end);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+        {
+            perror("read");
+            code = 2;
+        }
+        else if (n == 0)
+        {
+            // stdin ended in the middle of a request
+            code = end ? 1 : 0;
         }
+        end += n > 0 ? n : 0;
     }
-    printf("added %s\n", element);
+    free(in);
+    free(out.data);
+    return code;
 }
 
 /**
- * Check if an element is in the file.
- * Method:
- * 1. Fetch first entry from hdr->first_element
- * 2. Iterate through the linked list of entries
- *  - If the entry is equal to element, it has been found
- *  - Exit if the next offset is 0
- * 3. Print out "found" or "not found" based on the loop result
- * 
- * @param {bigbag_hdr_s} hdr - header of the file
- * @param {char} element - element to add to file
+ * A command of a batch for the shard workers.
+**/
+struct shard_job_s
+{
+    char command;
+    char *element;
+    uint32_t shard;
+    int status;
+};
+
+/**
+ * Worker threads of -S. Each shard belongs to one worker (shard % threads),
+ * which runs the commands of a batch for its shards in order.
+**/
+struct shard_pool_s
+{
+    struct bigbag_shards_s *store;
+    uint32_t threads;
+    pthread_mutex_t lock;
+    // signaled when a batch is ready, and when the last worker is done
+    pthread_cond_t start;
+    pthread_cond_t done;
+    struct shard_job_s *jobs;
+    uint32_t job_count;
+    // bumped for every batch, so each worker runs it once
+    uint64_t batch;
+    uint32_t running;
+    bool stop;
+};
+
+/**
+ * Argument of shardWorker.
 **/
-void checkElement(struct bigbag_hdr_s *hdr, char *element)
+struct shard_worker_s
 {
-    bool found = false;
-    struct bigbag_entry_s *entry;
-    uint32_t first_element = hdr->first_element;
-    // fetch first entry
-    entry = entry_addr(hdr, first_element);
-    while (entry)
+    struct shard_pool_s *pool;
+    uint32_t id;
+};
+
+/**
+ * Thread of the pool: wait for a batch, run the commands of its shards,
+ * report back, repeat until the pool stops.
+**/
+void *shardWorker(void *arg)
+{
+    struct shard_worker_s *worker = arg;
+    struct shard_pool_s *pool = worker->pool;
+    uint64_t batch = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
     {
-        if (strcmp(entry->str, element) == 0)
-        {
-            found = true;
+        while (!pool->stop && pool->batch == batch)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->stop)
             break;
+        batch = pool->batch;
+        pthread_mutex_unlock(&pool->lock);
+        for (uint32_t i = 0; i < pool->job_count; i++)
+        {
+            struct shard_job_s *job = &pool->jobs[i];
+            if (job->shard % pool->threads == worker->id)
+                job->status = runCommand(NULL, pool->store, job->command, job->element, NULL);
         }
-        // fetch next entry
-        unsigned int nextOffset = entry->next;
-        if (nextOffset == 0)
-            break;
-        entry = entry_addr(hdr, nextOffset);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0)
+            pthread_cond_signal(&pool->done);
     }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
 
-    if (found)
-        printf("found\n");
-    else
-        printf("not found\n");
+/**
+ * Run a batch of commands on the pool and print their responses in order.
+ *
+ * @param {shard_pool_s} pool - the pool
+ * @param {shard_job_s} jobs - the commands
+ * @param {uint32_t} count - number of commands
+**/
+void runBatch(struct shard_pool_s *pool, struct shard_job_s *jobs, uint32_t count)
+{
+    if (count == 0)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->jobs = jobs;
+    pool->job_count = count;
+    pool->running = pool->threads;
+    pool->batch++;
+    pthread_cond_broadcast(&pool->start);
+    while (pool->running)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    for (uint32_t i = 0; i < count; i++)
+        printResult(jobs[i].command, jobs[i].element, jobs[i].status, 0);
 }
 
 /**
- * Remove an element from the file.
+ * Run the text commands from stdin on a sharded store until it ends.
  * Method:
- * 1. Use the 2 runner algorithm to determine the position of the element
- * 2. If front equals element, we have found the element to remove
- *  - Corner case #1: Remove the first element
- *  - Corner case #2: Remove the last element
- *  - Corner case #3: Element not in list
- *  - Note: My loop covers corner case #2
- * 3. Remove the element
- *  - Point back->next to front->next
- *  - Reset front->entry_magic to free
- *  - Reset front->next
- * 
- * 
- * @param {bigbag_hdr_s} hdr - header of the file
- * @param {char} element - element to add to file
+ * 1. Read as much as stdin has and split it into lines
+ * 2. Collect a, d and c commands into a batch; the pool runs the batch
+ *    with one worker per shard, so commands on different shards run in
+ *    parallel and commands on one shard run in order
+ * 3. Other commands run the batch collected so far first, then run on
+ *    this thread: l, p and r merge the shards, b splits its file by shard
+ * 4. Print the responses of the batch in order and flush them before
+ *    waiting for more input
+ *
+ * Returns the exit code of the program.
+ *
+ * @param {bigbag_shards_s} store - the open store
+ * @param {uint32_t} threads - number of workers
 **/
-void deleteElement(struct bigbag_hdr_s *hdr, char *element)
+int serveShards(struct bigbag_shards_s *store, uint32_t threads)
 {
-    struct bigbag_entry_s *front, *back;
-    front = entry_addr(hdr, hdr->first_element);
-    back = front;
-    while (front)
+    struct shard_pool_s pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.store = store;
+    pool.threads = threads;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.start, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pthread_t *ids = malloc(threads * sizeof(pthread_t));
+    struct shard_worker_s *workers = malloc(threads * sizeof(struct shard_worker_s));
+    for (uint32_t i = 0; i < threads; i++)
     {
-        // Front and element are equlivalent
-        if (strcmp(element, front->str) == 0)
+        workers[i].pool = &pool;
+        workers[i].id = i;
+        pthread_create(&ids[i], NULL, shardWorker, &workers[i]);
+    }
+
+    size_t cap = 64 * 1024;
+    char *in = malloc(cap);
+    size_t end = 0;
+    uint32_t job_cap = 1024;
+    struct shard_job_s *jobs = malloc(job_cap * sizeof(struct shard_job_s));
+    bool eof = false;
+    int code = 0;
+    while (!eof)
+    {
+        ssize_t n = read(STDIN_FILENO, in + end, cap - end);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+        {
+            perror("read");
+            code = 2;
+            break;
+        }
+        eof = n == 0;
+        end += n;
+        // at the end of input, the last line may have no line break
+        if (eof && end && in[end - 1] != '\n')
         {
-            // Resolves corner case #1: Remove first element
-            if (back == front)
+            if (end == cap)
+                in = realloc(in, ++cap);
+            in[end++] = '\n';
+        }
+
+        uint32_t job_count = 0;
+        char *line = in;
+        char *newline;
+        while ((newline = memchr(line, '\n', in + end - line)))
+        {
+            // Remove line break
+            *newline = 0;
+            size_t len = newline - line;
+            // Element to be added/deleted/checked, after the command and a space
+            char *element = line + (len > 2 ? 2 : len);
+            if (line[0] && strchr("adc", line[0]))
             {
-                // point the first free space to the next element
-                hdr->first_element = front->next;
-                // Clear front
-                front->entry_magic = BIGBAG_FREE_ENTRY_MAGIC;
-                front->next = 0;
+                if (job_count == job_cap)
+                {
+                    job_cap *= 2;
+                    jobs = realloc(jobs, job_cap * sizeof(struct shard_job_s));
+                }
+                struct shard_job_s job = {line[0], element, bigbag_shard_of(store, element), BIGBAG_OK};
+                jobs[job_count++] = job;
             }
             else
             {
-                back->next = front->next;
-                front->entry_magic = BIGBAG_FREE_ENTRY_MAGIC;
-                front->next = 0;
+                runBatch(&pool, jobs, job_count);
+                job_count = 0;
+                if (line[0] == 'l')
+                    listElements(NULL, store);
+                else if (line[0] == 'p' || line[0] == 'r')
+                    listRange(NULL, store, line[0], element);
+                else if (line[0] == 'b')
+                {
+                    uint32_t count = 0;
+                    int status = runCommand(NULL, store, 'b', element, &count);
+                    printResult('b', element, status, count);
+                }
+                else
+                    printCommands(line);
             }
-            break;
+            line = newline + 1;
+        }
+        runBatch(&pool, jobs, job_count);
+        fflush(stdout);
+
+        // keep the partial line, and make room for the rest of it
+        end -= line - in;
+        memmove(in, line, end);
+        if (end == cap)
+        {
+            cap *= 2;
+            in = realloc(in, cap);
         }
-        // fetch next entry
-        unsigned int nextOffset = front->next;
-        back = front;
-        front = entry_addr(hdr, nextOffset);
-    }
-    // Resolves corner case #3: element not in list
-    if (!front)
-    {
-        printf("no %s\n", element);
-        return;
     }
-    printf("deleted %s\n", element);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = true;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+    for (uint32_t i = 0; i < threads; i++)
+        pthread_join(ids[i], NULL);
+    free(ids);
+    free(workers);
+    free(jobs);
+    free(in);
+    return code;
 }
 
 /**
- * Main method.
- * 
- * @param {bigbag_hdr_s} hdr - header of the file
- * @param {char} element - element to add to file
+ * Open a sharded store for -S and serve it.
+ *
+ * @param {char} spec - "shards" or "shards,threads" from the command line
+ * @param {char} dirname - directory of the store
 **/
-int main(int argc, char **argv)
+int serveStore(char *spec, char *dirname)
 {
-    // Check for correct number of arguments
-    if (argc <= 1)
+    uint32_t shards = 0;
+    uint32_t threads = 0;
+    if (sscanf(spec, "%u,%u", &shards, &threads) < 1)
     {
-        printf("USAGE: ./bigbag [-t] filename\n");
+        printf("-S takes shards or shards,threads\n");
         return 1;
     }
-
-    // Open the file depending on the number of parameteres
-    int fd;
-    if (strcmp(argv[1], "-t") == 0)
+    int status;
+    struct bigbag_shards_s *store = bigbag_shards_open(dirname, shards, NULL, &status);
+    if (!store)
     {
-        fd = open(argv[2], O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+        printf("%s: %s\n", dirname, status == BIGBAG_ERR_FORMAT ? "wrong number of shards"
+                                                                : bigbag_strerror(status));
+        return status == BIGBAG_ERR_FORMAT ? 4 : 2;
     }
-    else
+    // by default one worker per shard, up to one per core
+    if (threads == 0)
     {
-        fd = open(argv[1], O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = bigbag_shards_count(store);
+        if (cores > 0 && threads > cores)
+            threads = cores;
     }
-    // Error opening file
-    if (fd == -1)
+    if (threads > bigbag_shards_count(store))
+        threads = bigbag_shards_count(store);
+    int code = serveShards(store, threads);
+    bigbag_shards_close(store);
+    return code;
+}
+
+int main(int argc, char **argv)
+{
+    // Optional -b in front of the other options
+    int arg = 1;
+    bool binary = argc > 1 && strcmp(argv[1], "-b") == 0;
+    if (binary)
+        arg++;
+    // Check for correct number of arguments
+    bool two_args = argc > arg && (strcmp(argv[arg], "-D") == 0 || strcmp(argv[arg], "-S") == 0 ||
+                                   strcmp(argv[arg], "-B") == 0);
+    if (argc <= arg || (argv[arg][0] == '-' && argc <= arg + 1) || (two_args && argc <= arg + 2) ||
+        (binary && (strcmp(argv[arg], "-S") == 0 || strcmp(argv[arg], "-B") == 0)))
     {
-        perror(argv[1]);
-        return 2;
+        printf("USAGE: ./bigbag [-b] [-t] filename\n");
+        printf("       ./bigbag [-b] -D ops[,ms] filename (durable, commit every ops changes or ms)\n");
+        printf("       ./bigbag -C filename (compact)\n");
+        printf("       ./bigbag -B input filename (build a new bag from input, one element per line)\n");
+        printf("       ./bigbag -S shards[,threads] dirname (sharded store, one bag per shard)\n");
+        printf("       -b: binary requests on stdin, see bigbag_proto.h\n");
+        return 1;
     }
-
-    // Determine mmap method (private/shared) based on the flag
-    void *file_base;
-    if (strcmp(argv[1], "-t") == 0)
+    if (strcmp(argv[arg], "-C") == 0)
     {
-        file_base = mmap(0, BIGBAG_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        return compactBag(argv[arg + 1]);
     }
-    else
+    if (strcmp(argv[arg], "-S") == 0)
     {
-        file_base = mmap(0, BIGBAG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        return serveStore(argv[arg + 1], argv[arg + 2]);
     }
-    // Memory map failed
-    if (file_base == MAP_FAILED)
+    if (strcmp(argv[arg], "-B") == 0)
     {
-        perror("mmap");
-        return 3;
+        return buildBag(argv[arg + 1], argv[arg + 2]);
     }
 
-    struct stat stat;
-    fstat(fd, &stat);
-    struct bigbag_hdr_s *hdr = file_base;
-    char *buffer = NULL;
-    size_t bufsize = 0;
-    // If file is size 0, make it the desired format
-    if (stat.st_size == 0)
+    // Open the file depending on the number of parameteres
+    struct bigbag_options_s options = {0, 0, 0};
+    char *filename = argv[arg];
+    if (strcmp(argv[arg], "-t") == 0)
     {
-        // Make file 64K
-        ftruncate(fd, 65536);
-        struct bigbag_hdr_s *header = file_base;
-        // create header
-        header->first_element = 0;
-        header->magic = BIGBAG_MAGIC;
-        header->first_free = sizeof(*header);
-        // Set up first entry of free space
-        struct bigbag_entry_s *entry = entry_addr(hdr, header->first_free);
-        entry->next = 0;
-        entry->entry_magic = BIGBAG_FREE_ENTRY_MAGIC;
-        entry->entry_len = 65536 - sizeof(*header) - sizeof(*entry);
+        options.flags = BIGBAG_PRIVATE;
+        filename = argv[arg + 1];
     }
-    // Command line interface
-    while (getline(&buffer, &bufsize, stdin))
+    else if (strcmp(argv[arg], "-D") == 0)
     {
-        // Remove line break
-        buffer[strlen(buffer) - 1] = 0;
-
-        // Element to be added/deleted/checked
-        char *element = malloc(strlen(buffer));
-        strncpy(element, buffer + 2, strlen(buffer));
-
-        // List
-        if (buffer[0] == 'l')
-        {
-            listElements(hdr);
-        }
-        // Add
-        else if (buffer[0] == 'a')
+        options.flags = BIGBAG_DURABLE;
+        if (sscanf(argv[arg + 1], "%u,%u", &options.commit_ops, &options.commit_ms) < 1)
         {
-            addElement(hdr, element);
-        }
-        // Delete
-        else if (buffer[0] == 'd')
-        {
-
-            deleteElement(hdr, element);
+            printf("-D takes ops or ops,ms\n");
+            return 1;
         }
-        // Check
-        else if (buffer[0] == 'c')
-        {
+        filename = argv[arg + 2];
+    }
+    int status;
+    struct bigbag_s *bag = bigbag_open(filename, &options, &status);
+    if (!bag)
+    {
+        printf("%s: %s\n", filename, bigbag_strerror(status));
+        return status == BIGBAG_ERR_FORMAT ? 4 : 2;
+    }
 
-            checkElement(hdr, element);
-        }
-        // Invalid command
-        else
-        {
-            printCommands(buffer);
-        }
-        // Free memory allocated for element
-        free(element);
+    int code = binary ? serveBinary(bag) : serveText(bag);
+    if (bigbag_close(bag) != BIGBAG_OK && code == 0)
+    {
+        perror("commit");
+        return 5;
     }
-    // Free buffer space
-    free(buffer);
-    return 0;
+    return code;
 }
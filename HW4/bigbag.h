@@ -2,11 +2,30 @@
 #pragma once
 
 #define BIGBAG_MAGIC 0xC5149BA9
+// bags with the extended header below (first_free/first_element keep their place)
+#define BIGBAG_MAGIC_V2 0xC5149BAA
+#define BIGBAG_VERSION 4
+// oldest version this code opens; newer fields of older bags are zero
+#define BIGBAG_MIN_VERSION 2
 #define BIGBAG_FREE_ENTRY_MAGIC 0xF4
 #define BIGBAG_USED_ENTRY_MAGIC 0xDA
+#define BIGBAG_INDEX_ENTRY_MAGIC 0x1D
+// the index of version 4 bags: bigbag_slot_s instead of bare offsets;
+// older indexes are rebuilt this way when the bag is opened
+#define BIGBAG_KEYED_INDEX_ENTRY_MAGIC 0x1E
 
-// bag files will always be 64K in size
+// new bag files start at 64K and double in size when they run out of space
 #define BIGBAG_SIZE (64*1024)
+// offsets are 32 bits, so a bag can't grow past 4G
+#define BIGBAG_MAX_SIZE 0xFFFFF000u
+// writers of a bag hold an OFD lock (fcntl) on this byte, past the end of
+// any bag, for as long as they change it; a durable bag holds it while it
+// is open. The flock of the file only keeps readers out while the file
+// itself is being written, so readers that take it never wait for a
+// durable bag to close.
+#define BIGBAG_WRITER_LOCK 0xFFFFFFFFull
+// largest entry_len of a single entry, kept 4-byte aligned
+#define BIGBAG_MAX_ENTRY_LEN 0xFFFFFC
 
 #pragma pack(1)
 struct bigbag_hdr_s {
@@ -14,6 +33,28 @@ struct bigbag_hdr_s {
     // these offsets are from the beginning of the bagfile or 0 if not set
     uint32_t first_free;
     uint32_t first_element;
+    // the fields below only exist when magic is BIGBAG_MAGIC_V2
+    uint32_t version;
+    // offset of the index entry: a slot for every element, sorted by string
+    uint32_t index;
+    // number of offsets in the index
+    uint32_t element_count;
+    // size of the bag file; old bags are always BIGBAG_SIZE
+    uint32_t size;
+    // even while the bag is consistent, odd while a writer is changing it
+    uint32_t seq;
+    // non-zero once bigbag_compact renamed a compacted copy over this file:
+    // processes that still have it open move to the file by its name
+    uint32_t moved;
+    // zero, room for new fields without moving the first entry
+    uint32_t reserved[7];
+};
+
+// the original header, used to find the first entry of old bags
+struct bigbag_hdr_v1_s {
+    uint32_t magic;
+    uint32_t first_free;
+    uint32_t first_element;
 };
 
 struct bigbag_entry_s {
@@ -23,6 +64,30 @@ struct bigbag_entry_s {
     char str[0];
 };
 
+// a group commit, written to <bagfile>.journal before any of it goes to
+// the bag; followed by pages x (uint64_t offset, page_size bytes of data)
+#define BIGBAG_JOURNAL_MAGIC 0xC5149BAB
+struct bigbag_journal_s {
+    uint32_t magic;
+    uint32_t page_size;
+    uint32_t pages;
+    // size of the bag file once the commit is applied
+    uint32_t size;
+    // FNV-1a of everything after this header
+    uint64_t checksum;
+};
+
+// a slot of the keyed index: the offset of an element and its first
+// BIGBAG_KEY_LEN bytes, big-endian and zero padded, so comparing keys
+// orders most slots like strcmp without reading the element
+#define BIGBAG_KEY_LEN 4
+struct bigbag_slot_s {
+    uint32_t offset;
+    uint32_t key;
+};
+
 #pragma pack()
 
-#define MIN_ENTRY_SIZE (sizeof(struct bigbag_entry_s) + 4)
\ No newline at end of file
+#define MIN_ENTRY_SIZE (sizeof(struct bigbag_entry_s) + 4)
+// number of slots a new bag's index has room for
+#define INDEX_INITIAL_SLOTS 64
@@ -0,0 +1,595 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "libbigbag.h"
+
+/**
+ * bigbag_bench: run a generated workload against a bag and report
+ * throughput, latency percentiles per operation and how full and
+ * fragmented the bag gets over time.
+ * With -R, reader processes check and list the bag while the workload
+ * grows it, and the run fails if any of them crashed or got an error.
+ * Build with: gcc -O2 -o bigbag_bench bigbag_bench.c libbigbag.c -lm
+**/
+
+// operations of the workload, in the order of the -m weights
+#define OP_ADD 0
+#define OP_DELETE 1
+#define OP_CHECK 2
+#define OP_LIST 3
+#define OP_COUNT 4
+
+static const char *op_names[OP_COUNT] = {"add", "delete", "check", "list"};
+
+// longest key the generator makes
+#define MAX_KEY_LEN 255
+// width of the counter at the front of sorted keys
+#define SORTED_DIGITS 6
+
+#define LEN_FIXED 0
+#define LEN_UNIFORM 1
+#define LEN_EXP 2
+
+/**
+ * Workload settings, from the command line.
+**/
+struct workload_s
+{
+    uint64_t ops;
+    // relative weights of add, delete, check and list
+    uint32_t mix[OP_COUNT];
+    // key lengths: LEN_FIXED min, LEN_UNIFORM min-max, LEN_EXP with mean min
+    int len_dist;
+    uint32_t len_min;
+    uint32_t len_max;
+    // fraction of added keys that are larger than every key before them
+    double sorted;
+    // fraction of deletes and checks that pick a key that was added
+    double hits;
+    // print fill and fragmentation every this many ops, 0 for never
+    uint64_t interval;
+    unsigned int seed;
+};
+
+/**
+ * Keys that were added and not deleted yet, to pick hits from.
+**/
+struct keys_s
+{
+    char **keys;
+    uint64_t count;
+    uint64_t cap;
+};
+
+/**
+ * Latencies of one kind of operation, in ns.
+**/
+struct latency_s
+{
+    uint64_t *ns;
+    uint64_t count;
+    uint64_t cap;
+    uint64_t total;
+};
+
+/**
+ * What the -R readers did, in memory shared with them.
+**/
+struct readers_s
+{
+    // set once the workload is done
+    uint32_t stop;
+    uint64_t reads;
+    uint64_t errors;
+};
+
+/**
+ * Print the usage of the tool.
+**/
+void printUsage(void)
+{
+    printf("USAGE: ./bigbag_bench [options] filename\n");
+    printf("  -n ops         operations to run (100000)\n");
+    printf("  -m a,d,c,l     weights of add, delete, check and list (60,20,20,0)\n");
+    printf("  -k dist        key lengths: fixed:N, uniform:MIN-MAX or exp:MEAN (uniform:4-32)\n");
+    printf("  -s fraction    fraction of adds with keys in increasing order (0)\n");
+    printf("  -h fraction    fraction of deletes and checks of keys in the bag (0.9)\n");
+    printf("  -i ops         report fill and fragmentation every ops operations (10000)\n");
+    printf("  -r seed        seed of the generator (1)\n");
+    printf("  -t             private bag (nothing is written to the file)\n");
+    printf("  -D ops[,ms]    durable bag, commit every ops changes or ms\n");
+    printf("  -K             keep the bag file after the run\n");
+    printf("  -R readers     processes that check and list the bag during the run (0)\n");
+    printf("The bag file must not exist; it is made for the run and removed afterwards.\n");
+}
+
+/**
+ * Parse the -k key length distribution.
+ * Returns false if it isn't one of fixed:N, uniform:MIN-MAX or exp:MEAN.
+ *
+ * @param {workload_s} workload - receives the distribution
+ * @param {char} spec - the distribution from the command line
+**/
+bool parseLengths(struct workload_s *workload, char *spec)
+{
+    if (sscanf(spec, "fixed:%u", &workload->len_min) == 1)
+    {
+        workload->len_dist = LEN_FIXED;
+        workload->len_max = workload->len_min;
+    }
+    else if (sscanf(spec, "uniform:%u-%u", &workload->len_min, &workload->len_max) == 2)
+    {
+        workload->len_dist = LEN_UNIFORM;
+    }
+    else if (sscanf(spec, "exp:%u", &workload->len_min) == 1)
+    {
+        workload->len_dist = LEN_EXP;
+        workload->len_max = MAX_KEY_LEN;
+    }
+    else
+    {
+        return false;
+    }
+    return workload->len_min >= 1 && workload->len_min <= workload->len_max && workload->len_max <= MAX_KEY_LEN;
+}
+
+/**
+ * Return a random number in [0, 1).
+**/
+double randomUnit(unsigned int *seed)
+{
+    return rand_r(seed) / ((double)RAND_MAX + 1);
+}
+
+/**
+ * Return the length of the next key.
+**/
+uint32_t keyLength(struct workload_s *workload, unsigned int *seed)
+{
+    if (workload->len_dist == LEN_UNIFORM)
+        return workload->len_min + rand_r(seed) % (workload->len_max - workload->len_min + 1);
+    if (workload->len_dist == LEN_EXP)
+    {
+        double len = -workload->len_min * log1p(-randomUnit(seed));
+        if (len < 1)
+            return 1;
+        return len > MAX_KEY_LEN ? MAX_KEY_LEN : (uint32_t)len;
+    }
+    return workload->len_min;
+}
+
+/**
+ * Generate a key.
+ * Sorted keys start with a base-26 counter, so each one is larger than
+ * all sorted keys before it; they are at least SORTED_DIGITS long.
+ *
+ * @param {workload_s} workload - the workload settings
+ * @param {char} key - receives the key, MAX_KEY_LEN + 1 bytes
+ * @param {uint64_t} sequence - counter of the sorted keys, NULL for a random key
+ * @param {unsigned int} seed - state of the generator
+**/
+void makeKey(struct workload_s *workload, char *key, uint64_t *sequence, unsigned int *seed)
+{
+    uint32_t len = keyLength(workload, seed);
+    uint32_t i = 0;
+    if (sequence)
+    {
+        if (len < SORTED_DIGITS)
+            len = SORTED_DIGITS;
+        uint64_t n = (*sequence)++;
+        for (i = SORTED_DIGITS; i > 0; i--, n /= 26)
+            key[i - 1] = 'a' + n % 26;
+        i = SORTED_DIGITS;
+    }
+    for (; i < len; i++)
+        key[i] = 'a' + rand_r(seed) % 26;
+    key[len] = 0;
+}
+
+/**
+ * Remember a key that was added.
+**/
+void keepKey(struct keys_s *keys, char *key)
+{
+    if (keys->count == keys->cap)
+    {
+        keys->cap = keys->cap ? keys->cap * 2 : 1024;
+        keys->keys = realloc(keys->keys, keys->cap * sizeof(char *));
+    }
+    keys->keys[keys->count++] = strdup(key);
+}
+
+/**
+ * Record the latency of an operation.
+**/
+void recordLatency(struct latency_s *latency, uint64_t ns)
+{
+    if (latency->count == latency->cap)
+    {
+        latency->cap = latency->cap ? latency->cap * 2 : 1024;
+        latency->ns = realloc(latency->ns, latency->cap * sizeof(uint64_t));
+    }
+    latency->ns[latency->count++] = ns;
+    latency->total += ns;
+}
+
+/**
+ * Return the current time in ns.
+**/
+static uint64_t nowNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Visitor for the list operation: count the elements.
+**/
+bool countElement(const char *element, void *arg)
+{
+    (void)element;
+    (*(uint64_t *)arg)++;
+    return true;
+}
+
+/**
+ * qsort comparison of two latencies.
+**/
+int compareNs(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Return the latency below which a fraction of the operations finished.
+ * The latencies must be sorted.
+**/
+double percentileUs(struct latency_s *latency, double fraction)
+{
+    uint64_t pos = fraction * latency->count;
+    if (pos >= latency->count)
+        pos = latency->count - 1;
+    return latency->ns[pos] / 1000.0;
+}
+
+/**
+ * Print how full and fragmented the bag is after a number of operations.
+ *
+ * @param {bigbag_s} bag - the open bag
+ * @param {uint64_t} ops - operations run so far
+**/
+void printFill(struct bigbag_s *bag, uint64_t ops)
+{
+    struct bigbag_stats_s stats;
+    bigbag_stats(bag, &stats);
+    uint64_t total = stats.used_bytes + stats.free_bytes;
+    double fill = total ? 100.0 * stats.used_bytes / total : 0;
+    double fragmentation = 0;
+    if (stats.free_bytes)
+        fragmentation = 100.0 * (stats.free_bytes - stats.largest_free) / stats.free_bytes;
+    printf("%10lu %10u %12lu %12lu %8u %6.1f%% %6.1f%%\n", ops, stats.elements, stats.used_bytes,
+           stats.free_bytes, stats.free_entries, fill, fragmentation);
+}
+
+/**
+ * Run the workload against the bag.
+ * Method:
+ * 1. Pick an operation by the -m weights
+ * 2. Pick its key: adds make a new one, deletes and checks take one that
+ *    was added (a hit) or make one that is likely not in the bag
+ * 3. Time the library call alone and record it for the operation
+ * 4. Every interval operations, print the fill and fragmentation
+ *
+ * @param {bigbag_s} bag - the open bag
+ * @param {workload_s} workload - the workload settings
+ * @param {latency_s} latencies - receives the latencies, one per operation
+ * @param {uint64_t} full - receives the number of adds that found no room
+**/
+void runWorkload(struct bigbag_s *bag, struct workload_s *workload, struct latency_s *latencies, uint64_t *full)
+{
+    unsigned int seed = workload->seed;
+    uint32_t weights = 0;
+    for (int op = 0; op < OP_COUNT; op++)
+        weights += workload->mix[op];
+    struct keys_s keys = {NULL, 0, 0};
+    uint64_t sequence = 0;
+    char key[MAX_KEY_LEN + 1];
+    if (workload->interval)
+        printf("%10s %10s %12s %12s %8s %7s %7s\n", "ops", "elements", "used", "free", "holes", "fill", "frag");
+    for (uint64_t i = 0; i < workload->ops; i++)
+    {
+        uint32_t pick = rand_r(&seed) % weights;
+        int op = 0;
+        while (pick >= workload->mix[op])
+            pick -= workload->mix[op++];
+
+        uint64_t hit = keys.count;
+        if (op == OP_ADD)
+            makeKey(workload, key, randomUnit(&seed) < workload->sorted ? &sequence : NULL, &seed);
+        else if (op != OP_LIST && keys.count && randomUnit(&seed) < workload->hits)
+            hit = rand_r(&seed) % keys.count;
+        else if (op != OP_LIST)
+            makeKey(workload, key, NULL, &seed);
+        char *element = hit < keys.count ? keys.keys[hit] : key;
+
+        uint64_t count = 0;
+        int status = BIGBAG_OK;
+        uint64_t start = nowNs();
+        if (op == OP_ADD)
+            status = bigbag_add(bag, element);
+        else if (op == OP_DELETE)
+            status = bigbag_delete(bag, element);
+        else if (op == OP_CHECK)
+            status = bigbag_check(bag, element);
+        else
+            status = bigbag_foreach(bag, countElement, &count);
+        recordLatency(&latencies[op], nowNs() - start);
+
+        if (op == OP_ADD && status == BIGBAG_OK)
+            keepKey(&keys, element);
+        else if (op == OP_ADD && status == BIGBAG_ERR_FULL)
+            (*full)++;
+        else if (op == OP_DELETE && status == BIGBAG_OK && hit < keys.count)
+        {
+            free(keys.keys[hit]);
+            keys.keys[hit] = keys.keys[--keys.count];
+        }
+        if (workload->interval && (i + 1) % workload->interval == 0)
+            printFill(bag, i + 1);
+    }
+    for (uint64_t i = 0; i < keys.count; i++)
+        free(keys.keys[i]);
+    free(keys.keys);
+}
+
+/**
+ * Body of a -R reader process: open the bag and check random keys,
+ * listing the whole bag every 16th read, until the workload is done.
+ * Exits 0, or 2 if the bag can't be opened.
+ *
+ * @param {char} filename - the bag file
+ * @param {workload_s} workload - the workload settings, for the keys
+ * @param {readers_s} readers - shared with the other processes
+ * @param {unsigned int} seed - seed of the reader's keys
+**/
+void runReader(const char *filename, struct workload_s *workload, struct readers_s *readers, unsigned int seed)
+{
+    struct bigbag_options_s options = {0, 0, 0};
+    int status;
+    struct bigbag_s *bag = bigbag_open(filename, &options, &status);
+    if (!bag)
+        _exit(2);
+    char key[MAX_KEY_LEN + 1];
+    for (uint64_t i = 0; !__atomic_load_n(&readers->stop, __ATOMIC_RELAXED); i++)
+    {
+        uint64_t count = 0;
+        if (i % 16 == 0)
+        {
+            status = bigbag_foreach(bag, countElement, &count);
+        }
+        else
+        {
+            makeKey(workload, key, NULL, &seed);
+            status = bigbag_check(bag, key);
+        }
+        if (status != BIGBAG_OK && status != BIGBAG_ERR_NOT_FOUND)
+            __atomic_add_fetch(&readers->errors, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&readers->reads, 1, __ATOMIC_RELAXED);
+    }
+    bigbag_close(bag);
+    _exit(0);
+}
+
+/**
+ * Start the -R reader processes.
+ * Returns the memory shared with them, NULL if it can't be mapped.
+ *
+ * @param {char} filename - the bag file
+ * @param {workload_s} workload - the workload settings
+ * @param {pid_t} pids - receives the process ids, count of them
+ * @param {uint32_t} count - number of readers
+**/
+struct readers_s *startReaders(const char *filename, struct workload_s *workload, pid_t *pids, uint32_t count)
+{
+    struct readers_s *readers = mmap(0, sizeof(*readers), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (readers == MAP_FAILED)
+        return NULL;
+    memset(readers, 0, sizeof(*readers));
+    fflush(stdout);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        pids[i] = fork();
+        if (pids[i] == 0)
+            runReader(filename, workload, readers, workload->seed + i + 1);
+    }
+    return readers;
+}
+
+/**
+ * Stop the -R readers and print what they did.
+ * Returns the number of readers that crashed, exited with an error or
+ * got an error from the library.
+ *
+ * @param {readers_s} readers - from startReaders
+ * @param {pid_t} pids - the process ids
+ * @param {uint32_t} count - number of readers
+**/
+uint64_t stopReaders(struct readers_s *readers, pid_t *pids, uint32_t count)
+{
+    __atomic_store_n(&readers->stop, 1, __ATOMIC_RELAXED);
+    uint64_t failed = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        int wstatus;
+        if (pids[i] == -1 || waitpid(pids[i], &wstatus, 0) == -1)
+        {
+            failed++;
+            continue;
+        }
+        if (WIFSIGNALED(wstatus))
+        {
+            printf("reader %u: %s\n", i, strsignal(WTERMSIG(wstatus)));
+            failed++;
+        }
+        else if (WEXITSTATUS(wstatus) != 0)
+        {
+            printf("reader %u: exit %d\n", i, WEXITSTATUS(wstatus));
+            failed++;
+        }
+    }
+    printf("%u readers: %lu reads, %lu errors\n", count, readers->reads, readers->errors);
+    failed += readers->errors;
+    munmap(readers, sizeof(*readers));
+    return failed;
+}
+
+/**
+ * Print throughput and latency percentiles of each operation.
+ * Throughput counts the time spent in the library only, not generating
+ * keys or collecting the fill reports.
+**/
+void printLatencies(struct latency_s *latencies)
+{
+    uint64_t ops = 0;
+    uint64_t elapsed_ns = 0;
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        ops += latencies[op].count;
+        elapsed_ns += latencies[op].total;
+    }
+    printf("%lu ops in %.3f s, %.0f ops/s\n", ops, elapsed_ns / 1e9, ops / (elapsed_ns / 1e9));
+    printf("%-8s %10s %12s %10s %10s %10s %10s\n", "op", "count", "ops/s", "p50 us", "p99 us", "p999 us",
+           "max us");
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        struct latency_s *latency = &latencies[op];
+        if (latency->count == 0)
+            continue;
+        qsort(latency->ns, latency->count, sizeof(uint64_t), compareNs);
+        printf("%-8s %10lu %12.0f %10.2f %10.2f %10.2f %10.2f\n", op_names[op], latency->count,
+               latency->count / (latency->total / 1e9), percentileUs(latency, 0.5), percentileUs(latency, 0.99),
+               percentileUs(latency, 0.999), latency->ns[latency->count - 1] / 1000.0);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct workload_s workload = {100000, {60, 20, 20, 0}, LEN_UNIFORM, 4, 32, 0, 0.9, 10000, 1};
+    struct bigbag_options_s options = {0, 0, 0};
+    bool keep = false;
+    uint32_t reader_count = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:m:k:s:h:i:r:tD:KR:")) != -1)
+    {
+        bool ok = true;
+        if (opt == 'n')
+            workload.ops = strtoull(optarg, NULL, 10);
+        else if (opt == 'm')
+            ok = sscanf(optarg, "%u,%u,%u,%u", &workload.mix[OP_ADD], &workload.mix[OP_DELETE],
+                        &workload.mix[OP_CHECK], &workload.mix[OP_LIST]) == OP_COUNT;
+        else if (opt == 'k')
+            ok = parseLengths(&workload, optarg);
+        else if (opt == 's')
+            workload.sorted = atof(optarg);
+        else if (opt == 'h')
+            workload.hits = atof(optarg);
+        else if (opt == 'i')
+            workload.interval = strtoull(optarg, NULL, 10);
+        else if (opt == 'r')
+            workload.seed = atoi(optarg);
+        else if (opt == 't')
+            options.flags = BIGBAG_PRIVATE;
+        else if (opt == 'D')
+        {
+            options.flags = BIGBAG_DURABLE;
+            ok = sscanf(optarg, "%u,%u", &options.commit_ops, &options.commit_ms) >= 1;
+        }
+        else if (opt == 'K')
+            keep = true;
+        else if (opt == 'R')
+            reader_count = strtoul(optarg, NULL, 10);
+        else
+            ok = false;
+        if (!ok)
+        {
+            printUsage();
+            return 1;
+        }
+    }
+    uint32_t weights = 0;
+    for (int op = 0; op < OP_COUNT; op++)
+        weights += workload.mix[op];
+    // readers of a private bag would never see the workload
+    if (optind != argc - 1 || weights == 0 || (reader_count && options.flags == BIGBAG_PRIVATE))
+    {
+        printUsage();
+        return 1;
+    }
+
+    // Never run on a bag that is already there: the run would change it
+    // and removing it afterwards would lose it. A journal left without its
+    // bag would be applied to the new one.
+    char *filename = argv[optind];
+    char journal[4096];
+    snprintf(journal, sizeof(journal), "%s.journal", filename);
+    if (access(journal, F_OK) == 0)
+    {
+        printf("%s: already exists\n", journal);
+        return 2;
+    }
+    int fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+    {
+        perror(filename);
+        return 2;
+    }
+    close(fd);
+    int status;
+    struct bigbag_s *bag = bigbag_open(filename, &options, &status);
+    if (!bag)
+    {
+        printf("%s: %s\n", filename, bigbag_strerror(status));
+        unlink(filename);
+        unlink(journal);
+        return 2;
+    }
+    struct latency_s latencies[OP_COUNT];
+    memset(latencies, 0, sizeof(latencies));
+    uint64_t full = 0;
+    pid_t *pids = calloc(reader_count, sizeof(pid_t));
+    struct readers_s *readers = NULL;
+    if (reader_count && !(readers = startReaders(filename, &workload, pids, reader_count)))
+        perror("readers");
+    runWorkload(bag, &workload, latencies, &full);
+    uint64_t failed = readers ? stopReaders(readers, pids, reader_count) : reader_count;
+    free(pids);
+    int closed = bigbag_close(bag);
+    if (!keep)
+    {
+        unlink(filename);
+        unlink(journal);
+    }
+    if (closed != BIGBAG_OK)
+    {
+        perror("commit");
+        return 5;
+    }
+    printLatencies(latencies);
+    if (full)
+        printf("%lu adds found the bag full\n", full);
+    for (int op = 0; op < OP_COUNT; op++)
+        free(latencies[op].ns);
+    return failed ? 6 : 0;
+}
@@ -3,11 +3,35 @@
 //
 
 #include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
 #include "bigbag.h"
+
+/**
+ * bigbag_dump: print every entry of a bag, or check it.
+ *   bigbag_dump bagfile          print the header and every entry
+ *   bigbag_dump --check bagfile  check the structure, print each problem
+ *                                and a summary; exits 1 if there are problems
+ *   bigbag_dump --stats bagfile  only print the summary
+ * Build with: gcc -O2 -o bigbag_dump bigbag_dump.c
+**/
+
+// what starts at an offset of the bag, in the map of the check
+#define KIND_NONE 0
+#define KIND_USED 1
+#define KIND_FREE 2
+#define KIND_INDEX 3
+
+// --check prints this many problems, then only counts them
+#define MAX_PROBLEMS 20
+
 struct bigbag_entry_s *entry_addr(void *hdr, uint32_t offset) {
     if (offset == 0) return NULL;
     return (struct bigbag_entry_s *)((char*)hdr + offset);
@@ -17,44 +41,522 @@ uint32_t entry_offset(void *hdr, void *entry) {
     return (uint32_t)((uint64_t)entry - (uint64_t)hdr);
 }
 
+/**
+ * State of a check: the bag, what the walks found so far and a map with
+ * 2 bits per possible entry offset saying what kind of entry starts there.
+**/
+struct check_s {
+    struct bigbag_hdr_s *hdr;
+    uint64_t size;
+    bool indexed;
+    // entries of indexed bags are 4-byte aligned, so only every 4th offset needs a kind
+    uint32_t grain;
+    uint8_t *kinds;
+    bool verbose;
+    uint64_t problems;
+    // the walk in file order
+    uint64_t used_entries;
+    uint64_t used_bytes;
+    uint64_t free_entries;
+    uint64_t free_bytes;
+    uint64_t largest_free;
+    uint64_t tail_bytes;
+    // the walks of the lists
+    uint64_t elements;
+    uint64_t scattered_links;
+    uint64_t free_linked;
+    // free entries of old bags that aren't on the free list
+    uint64_t free_unlinked;
+    uint64_t adjacent_free;
+    // the index
+    struct bigbag_entry_s *index;
+    uint64_t index_slots;
+    // run of slots with the same key, and element reads of the lookups of
+    // the runs so far
+    uint32_t run_key;
+    uint64_t run_len;
+    double element_reads;
+};
 
-int main(int argc, char **argv) {
-    int fd = open(argv[1], O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-    if (fd == -1) {
-        perror(argv[1]);
-        return 2;
+/**
+ * Count a problem and, for --check, print it.
+**/
+void problem(struct check_s *check, const char *format, ...) {
+    if (check->verbose && check->problems < MAX_PROBLEMS) {
+        va_list args;
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+        printf("\n");
     }
+    check->problems++;
+}
 
-    void *file_base = mmap(0, BIGBAG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (file_base == MAP_FAILED) {
-        perror("mmap");
-        return 3;
+void setKind(struct check_s *check, uint64_t offset, int kind) {
+    uint64_t slot = offset / check->grain;
+    check->kinds[slot / 4] |= kind << (slot % 4 * 2);
+}
+
+/**
+ * Return the kind of entry starting at an offset, KIND_NONE if no entry
+ * starts there.
+**/
+int kindAt(struct check_s *check, uint64_t offset) {
+    if (offset % check->grain || offset >= check->size)
+        return KIND_NONE;
+    uint64_t slot = offset / check->grain;
+    return check->kinds[slot / 4] >> (slot % 4 * 2) & 3;
+}
+
+/**
+ * Return the key of an index slot for a string, like libbigbag does.
+**/
+uint32_t slotKey(const char *str) {
+    uint32_t key = 0;
+    for (int i = 0; i < BIGBAG_KEY_LEN; i++) {
+        key = key << 8 | (unsigned char)*str;
+        if (*str) str++;
+    }
+    return key;
+}
+
+bool allZero(const char *bytes, uint64_t len) {
+    for (uint64_t i = 0; i < len; i++)
+        if (bytes[i]) return false;
+    return true;
+}
+
+/**
+ * Check the header.
+ * Returns false if the rest of the bag can't be walked safely.
+**/
+bool checkHeader(struct check_s *check, uint64_t file_size) {
+    struct bigbag_hdr_s *hdr = check->hdr;
+    // some old bags have the magic in network byte order
+    if (file_size < sizeof(struct bigbag_hdr_v1_s) || (hdr->magic != BIGBAG_MAGIC &&
+        hdr->magic != htonl(BIGBAG_MAGIC) && hdr->magic != BIGBAG_MAGIC_V2)) {
+        problem(check, "not a bag: magic %08x", file_size < sizeof(hdr->magic) ? 0 : htonl(hdr->magic));
+        return false;
+    }
+    if (!check->indexed) {
+        if (file_size < BIGBAG_SIZE) {
+            problem(check, "bag is %lu bytes, old bags are %u", file_size, BIGBAG_SIZE);
+            return false;
+        }
+        return true;
+    }
+    if (file_size < sizeof(*hdr)) {
+        problem(check, "file is %lu bytes, too short for the header", file_size);
+        return false;
+    }
+    if (hdr->version < BIGBAG_MIN_VERSION || hdr->version > BIGBAG_VERSION) {
+        problem(check, "unsupported bag version %u", hdr->version);
+        return false;
+    }
+    if (hdr->size > file_size || hdr->size < sizeof(*hdr)) {
+        problem(check, "bag size %u, file is %lu bytes", hdr->size, file_size);
+        return false;
+    }
+    if (hdr->seq % 2)
+        problem(check, "seq %u is odd: a writer died while changing the bag", hdr->seq);
+    return true;
+}
+
+/**
+ * Walk the entries in file order: check each one, add it up and note its
+ * kind in the map.
+ * Method:
+ * 1. Each entry must fit in the bag and have a known magic
+ * 2. Elements must end with a 0 within their entry
+ * 3. The only index entry is the one hdr->index names
+ * 4. Stop at the first entry that can't be trusted, its length says
+ *    nothing about where the next one starts
+ *
+ * The original bigbag lost 4 bytes at the end of the bag with every add,
+ * so old bags may end in zeros that belong to no entry.
+ *
+ * @param {check_s} check - the check
+**/
+void walkEntries(struct check_s *check) {
+    struct bigbag_hdr_s *hdr = check->hdr;
+    uint64_t offset = check->indexed ? sizeof(*hdr) : sizeof(struct bigbag_hdr_v1_s);
+    while (offset < check->size) {
+        struct bigbag_entry_s *entry = entry_addr(hdr, offset);
+        uint64_t left = check->size - offset;
+        if (!check->indexed && allZero((char *)entry, left)) {
+            check->tail_bytes = left;
+            return;
+        }
+        if (left < sizeof(*entry)) {
+            problem(check, "%lu bytes at %lu are too short for an entry", left, offset);
+            return;
+        }
+        uint64_t len = sizeof(*entry) + entry->entry_len;
+        if (len > left) {
+            problem(check, "entry at %lu runs %lu bytes past the end of the bag", offset, len - left);
+            return;
+        }
+        if (check->indexed && entry->entry_len % 4) {
+            problem(check, "entry at %lu has length %u, not a multiple of 4", offset, entry->entry_len);
+            return;
+        }
+        switch (entry->entry_magic) {
+            case BIGBAG_USED_ENTRY_MAGIC:
+                if (strnlen(entry->str, entry->entry_len) == entry->entry_len) {
+                    problem(check, "element at %lu doesn't end within its entry", offset);
+                    break;
+                }
+                setKind(check, offset, KIND_USED);
+                check->used_entries++;
+                check->used_bytes += len;
+                break;
+            case BIGBAG_FREE_ENTRY_MAGIC:
+                setKind(check, offset, KIND_FREE);
+                check->free_entries++;
+                check->free_bytes += len;
+                if (entry->entry_len > check->largest_free) check->largest_free = entry->entry_len;
+                break;
+            case BIGBAG_INDEX_ENTRY_MAGIC:
+            case BIGBAG_KEYED_INDEX_ENTRY_MAGIC:
+                if (!check->indexed || offset != hdr->index)
+                    problem(check, "index entry at %lu is not the index of the bag", offset);
+                setKind(check, offset, KIND_INDEX);
+                break;
+            default:
+                problem(check, "bad magic %02x at %lu", entry->entry_magic, offset);
+                return;
+        }
+        offset += len;
+    }
+}
+
+/**
+ * Check that the index entry is the one the version of the bag calls for
+ * and has room for every element.
+ * Sets check->index, or leaves it NULL if the index can't be used.
+**/
+void checkIndex(struct check_s *check) {
+    struct bigbag_hdr_s *hdr = check->hdr;
+    if (kindAt(check, hdr->index) != KIND_INDEX) {
+        problem(check, "index %u is not an index entry", hdr->index);
+        return;
+    }
+    struct bigbag_entry_s *index = entry_addr(hdr, hdr->index);
+    bool keyed = index->entry_magic == BIGBAG_KEYED_INDEX_ENTRY_MAGIC;
+    if (keyed != (hdr->version >= 4))
+        problem(check, "version %u bag with a%s index", hdr->version, keyed ? " keyed" : "n unkeyed");
+    check->index_slots = index->entry_len / (keyed ? sizeof(struct bigbag_slot_s) : sizeof(uint32_t));
+    if (hdr->element_count > check->index_slots) {
+        problem(check, "index has %lu slots for %u elements", check->index_slots, hdr->element_count);
+        return;
+    }
+    check->index = index;
+}
+
+/**
+ * Return the most probes a binary search makes among n slots: the number
+ * of bits of n, that is log2(n + 1) rounded up.
+**/
+uint32_t searchProbes(uint64_t n) {
+    uint32_t probes = 0;
+    for (; n; n >>= 1)
+        probes++;
+    return probes;
+}
+
+/**
+ * Add up the element reads of looking up each element of a run of slots
+ * with the same key. Once the binary search is down to the run, every
+ * probe reads the element, up to searchProbes(run length) of them. Keys
+ * that end in a zero byte never need the element.
+**/
+void endRun(struct check_s *check) {
+    if (check->run_key & 0xFF)
+        check->element_reads += check->run_len * searchProbes(check->run_len);
+    check->run_len = 0;
+}
+
+/**
+ * Walk the list of elements from hdr->first_element.
+ * Method:
+ * 1. Every link must land on the start of a used entry; one that lands on
+ *    a free entry means the lists overlap
+ * 2. Find cycles by marking the element at every power of 2 hops: in a
+ *    cycle the walk comes back to a mark within twice its length
+ * 3. Elements must not be smaller than the one before them
+ * 4. The index is sorted the same way, so slot i holds the i-th element
+ *    of the list, with the key of that element; only the first slot that
+ *    doesn't is reported
+ * 5. Every used entry must be on the list, and the header must count them
+ *
+ * @param {check_s} check - the check
+**/
+void walkElements(struct check_s *check) {
+    struct bigbag_hdr_s *hdr = check->hdr;
+    bool keyed = check->index && check->index->entry_magic == BIGBAG_KEYED_INDEX_ENTRY_MAGIC;
+    // past the first slot that disagrees with the list, all of them would
+    bool compare_index = check->index != NULL;
+    const char *prev = NULL;
+    uint32_t offset = hdr->first_element;
+    uint32_t from = 0;
+    // Brent: a cycle comes back to the element marked at the last power of 2
+    uint32_t mark = 0;
+    uint64_t next_mark = 1;
+    while (offset) {
+        int kind = kindAt(check, offset);
+        if (kind != KIND_USED) {
+            problem(check, "element link from %u to %u lands on %s", from, offset,
+                    kind == KIND_FREE ? "a free entry" : kind == KIND_INDEX ? "the index" : "no entry");
+            break;
+        }
+        if (offset == mark || check->elements == check->used_entries) {
+            problem(check, "element list has a cycle through %u", offset);
+            break;
+        }
+        if (check->elements == next_mark) {
+            mark = offset;
+            next_mark *= 2;
+        }
+        struct bigbag_entry_s *entry = entry_addr(hdr, offset);
+        if (prev && strcmp(prev, entry->str) > 0)
+            problem(check, "element at %u is smaller than the one before it at %u", offset, from);
+        if (compare_index && check->elements < hdr->element_count) {
+            uint64_t i = check->elements;
+            uint32_t slot = keyed ? ((struct bigbag_slot_s *)check->index->str)[i].offset
+                                  : ((uint32_t *)check->index->str)[i];
+            if (slot != offset) {
+                problem(check, "index slot %lu points at %u, element %lu of the list is at %u", i, slot, i,
+                        offset);
+                compare_index = false;
+            } else if (keyed) {
+                struct bigbag_slot_s *slots = (struct bigbag_slot_s *)check->index->str;
+                if (slots[i].key != slotKey(entry->str))
+                    problem(check, "index slot %lu has key %08x, its element %08x", i, slots[i].key,
+                            slotKey(entry->str));
+                else if (i && slots[i].key == check->run_key)
+                    check->run_len++;
+                else {
+                    endRun(check);
+                    check->run_key = slots[i].key;
+                    check->run_len = 1;
+                }
+            }
+        }
+        if (entry->next && entry->next != offset + sizeof(*entry) + entry->entry_len)
+            check->scattered_links++;
+        check->elements++;
+        prev = entry->str;
+        from = offset;
+        offset = entry->next;
     }
+    endRun(check);
+    if (check->elements < check->used_entries)
+        problem(check, "%lu used entries are not on the element list", check->used_entries - check->elements);
+    if (check->indexed && check->elements != hdr->element_count)
+        problem(check, "header counts %u elements, the list has %lu", hdr->element_count, check->elements);
+}
 
+/**
+ * Walk the free list from hdr->first_free.
+ * Free entries are kept in file order, so each link must move forward
+ * (which also rules out cycles) and land on the start of a free entry.
+ *
+ * @param {check_s} check - the check
+**/
+void walkFree(struct check_s *check) {
+    struct bigbag_hdr_s *hdr = check->hdr;
+    uint32_t offset = hdr->first_free;
+    uint64_t prev_end = 0;
+    uint32_t from = 0;
+    while (offset) {
+        int kind = kindAt(check, offset);
+        if (kind != KIND_FREE) {
+            problem(check, "free link from %u to %u lands on %s", from, offset,
+                    kind == KIND_USED ? "an element" : kind == KIND_INDEX ? "the index" : "no entry");
+            break;
+        }
+        if (offset <= from) {
+            problem(check, "free link from %u goes back to %u", from, offset);
+            break;
+        }
+        struct bigbag_entry_s *entry = entry_addr(hdr, offset);
+        if (offset == prev_end)
+            check->adjacent_free++;
+        check->free_linked++;
+        prev_end = offset + sizeof(*entry) + entry->entry_len;
+        from = offset;
+        offset = entry->next;
+    }
+    // old bags never put deleted entries on the free list
+    if (check->free_linked < check->free_entries && check->indexed)
+        problem(check, "%lu free entries are not on the free list", check->free_entries - check->free_linked);
+    else if (check->free_linked < check->free_entries)
+        check->free_unlinked = check->free_entries - check->free_linked;
+}
+
+/**
+ * Print the summary of a check.
+ * Lookups in indexed bags binary search the index, so their hops are the
+ * probes of the search; with a keyed index only the probes among slots
+ * with the key of the element read it (endRun). Old bags walk the list: a hit takes
+ * (n + 1) / 2 hops on average.
+**/
+void printSummary(struct check_s *check) {
+    struct bigbag_hdr_s *hdr = check->hdr;
+    if (check->indexed)
+        printf("bag: %lu bytes, version %u\n", check->size, hdr->version);
+    else
+        printf("bag: %lu bytes, old format without an index\n", check->size);
+    printf("elements: %lu live in %lu bytes\n", check->elements, check->used_bytes);
+    double fragmentation = 0;
+    if (check->free_bytes)
+        fragmentation = (double)(check->free_bytes - check->largest_free) / check->free_bytes;
+    printf("free: %lu bytes in %lu entries, largest %lu, fragmentation %.3f\n", check->free_bytes,
+           check->free_entries, check->largest_free, fragmentation);
+    if (check->adjacent_free)
+        printf("free: %lu entries could be merged with the one before them\n", check->adjacent_free);
+    if (check->tail_bytes)
+        printf("lost: %lu bytes at the end of the bag in no entry\n", check->tail_bytes);
+    if (check->free_unlinked)
+        printf("lost: %lu deleted entries the old format never reuses\n", check->free_unlinked);
+    if (check->elements)
+        printf("list: %.1f%% of the links jump\n", 100.0 * check->scattered_links / check->elements);
+    if (check->index) {
+        uint32_t probes = searchProbes(check->elements);
+        printf("index: %u of %lu slots used\n", hdr->element_count, check->index_slots);
+        if (check->index->entry_magic == BIGBAG_KEYED_INDEX_ENTRY_MAGIC) {
+            double reads = check->elements ? check->element_reads / check->elements : 0;
+            printf("lookup: %u index probes, %.1f of them read the element\n", probes, reads);
+        } else {
+            printf("lookup: %u index probes, each reads the element\n", probes);
+        }
+    } else if (!check->indexed && check->elements) {
+        printf("lookup: %.1f list hops per hit\n", (check->elements + 1) / 2.0);
+    }
+    printf("problems: %lu\n", check->problems);
+}
+
+/**
+ * Check a bag in one walk of its entries and one walk of each list, and
+ * print the summary.
+ * Returns the number of problems found.
+ *
+ * @param {void} file_base - the mapped bag file
+ * @param {uint64_t} file_size - size of the file
+ * @param {bool} verbose - print each problem (--check)
+**/
+uint64_t checkBag(void *file_base, uint64_t file_size, bool verbose) {
+    struct check_s check;
+    memset(&check, 0, sizeof(check));
+    check.hdr = file_base;
+    check.verbose = verbose;
+    check.indexed = file_size >= sizeof(check.hdr->magic) && check.hdr->magic == BIGBAG_MAGIC_V2;
+    check.grain = check.indexed ? 4 : 1;
+    if (checkHeader(&check, file_size)) {
+        check.size = check.indexed ? check.hdr->size : BIGBAG_SIZE;
+        check.kinds = calloc(check.size / check.grain / 4 + 1, 1);
+        walkEntries(&check);
+        if (check.indexed)
+            checkIndex(&check);
+        walkElements(&check);
+        walkFree(&check);
+        free(check.kinds);
+    }
+    if (verbose && check.problems > MAX_PROBLEMS)
+        printf("... %lu more problems\n", check.problems - MAX_PROBLEMS);
+    printSummary(&check);
+    return check.problems;
+}
+
+void dumpBag(void *file_base, uint64_t file_size) {
     struct bigbag_hdr_s *hdr = file_base;
 
-    struct stat stat;
-    fstat(fd, &stat);
-    printf("size = %ld\n", stat.st_size);
+    printf("size = %ld\n", file_size);
     printf("magic = %08x\n", htonl(hdr->magic));
     printf("first_free = %d\n", hdr->first_free);
     printf("first_element = %d\n", hdr->first_element);
+    uint32_t offset = sizeof(struct bigbag_hdr_v1_s);
+    if (hdr->magic == BIGBAG_MAGIC_V2) {
+        printf("version = %d\n", hdr->version);
+        printf("index = %d\n", hdr->index);
+        printf("element_count = %d\n", hdr->element_count);
+        printf("bag size = %u\n", hdr->size);
+        offset = sizeof(*hdr);
+    }
     struct bigbag_entry_s *entry;
-    int offset = sizeof(*hdr);
-    while (offset + sizeof(*entry) < stat.st_size) {
+    while (offset + sizeof(*entry) < file_size) {
         entry = entry_addr(hdr, offset);
         if (entry == NULL) {
-            printf("bad entry at offset %d\n", offset);
+            printf("bad entry at offset %u\n", offset);
             break;
         }
         printf("----------------\n");
-        printf("entry offset: %d\n", offset);
+        printf("entry offset: %u\n", offset);
         printf("entry magic: %x\n", (int)entry->entry_magic);
         printf("entry len: %d\n", entry->entry_len);
         printf("entry next offset: %d\n", entry->next);
         if (entry->entry_magic == BIGBAG_USED_ENTRY_MAGIC) {
             printf("entry data: %s\n", entry->str);
         }
+        if (entry->entry_magic == BIGBAG_INDEX_ENTRY_MAGIC && offset == hdr->index) {
+            uint32_t *slots = (uint32_t *)entry->str;
+            printf("index slots: %d of %d\n", hdr->element_count, (int)(entry->entry_len / sizeof(uint32_t)));
+            for (uint32_t i = 0; i < hdr->element_count; i++) {
+                printf("  [%d] %d %s\n", i, slots[i], entry_addr(hdr, slots[i])->str);
+            }
+        }
+        if (entry->entry_magic == BIGBAG_KEYED_INDEX_ENTRY_MAGIC && offset == hdr->index) {
+            struct bigbag_slot_s *slots = (struct bigbag_slot_s *)entry->str;
+            printf("index slots: %d of %d\n", hdr->element_count,
+                   (int)(entry->entry_len / sizeof(struct bigbag_slot_s)));
+            for (uint32_t i = 0; i < hdr->element_count; i++) {
+                printf("  [%d] %d %08x %s\n", i, slots[i].offset, slots[i].key,
+                       entry_addr(hdr, slots[i].offset)->str);
+            }
+        }
         offset += sizeof(*entry) + entry->entry_len;
     }
-}
\ No newline at end of file
+}
+
+int main(int argc, char **argv) {
+    bool check = argc == 3 && strcmp(argv[1], "--check") == 0;
+    bool stats = argc == 3 && strcmp(argv[1], "--stats") == 0;
+    if (argc != 2 && !check && !stats) {
+        printf("USAGE: ./bigbag_dump [--check | --stats] bagfile\n");
+        return 1;
+    }
+    char *filename = argv[argc - 1];
+    // the checks only read, so they never create the file
+    int fd = check || stats ? open(filename, O_RDONLY) : open(filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        perror(filename);
+        return 2;
+    }
+
+    struct stat stat;
+    fstat(fd, &stat);
+    if (!check && !stats) {
+        void *file_base = mmap(0, stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (file_base == MAP_FAILED) {
+            perror("mmap");
+            return 3;
+        }
+        dumpBag(file_base, stat.st_size);
+        return 0;
+    }
+
+    // Keep writers out while checking: they hold the flock while they
+    // change the file, a durable bag only while it commits.
+    flock(fd, LOCK_SH);
+    fstat(fd, &stat);
+    void *file_base = stat.st_size ? mmap(0, stat.st_size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+    if (file_base == MAP_FAILED) {
+        perror("mmap");
+        return 3;
+    }
+    if (!file_base) {
+        printf("%s: empty file\n", filename);
+        return 1;
+    }
+    return checkBag(file_base, stat.st_size, check) && check ? 1 : 0;
+}
@@ -0,0 +1,46 @@
+#include <stdint.h>
+#pragma once
+
+/**
+ * Binary protocol of bigbag -b, for clients that pipeline requests.
+ *
+ * A client writes requests back to back on stdin: a bigbag_request_s
+ * followed by len bytes of payload. Every request gets a
+ * bigbag_response_s followed by len bytes of payload on stdout, in the
+ * order of the requests. Responses are written in one go for all
+ * requests that arrived together, so a client can send thousands of
+ * requests before it reads any response.
+ *
+ * Integers are in the byte order of the host, like the bag file.
+ *
+ * Requests, named after the text commands:
+ *  'a', 'd', 'c', 'p', 'b', 's'
+ *                           payload: the element, prefix or file name
+ *                           with its terminating 0
+ *  'r'                      payload: first and last element of the range,
+ *                           each with its terminating 0
+ *  'l'                      no payload
+ *
+ * Responses: status is one of the BIGBAG_* status codes of libbigbag.h,
+ * or BIGBAG_ERR_REQUEST. 'l', 'p' and 'r' return the elements, each with
+ * its terminating 0; 'b' returns the number of elements added as a
+ * uint32_t; everything else returns no payload.
+**/
+
+// the request is malformed or names an unknown command
+#define BIGBAG_ERR_REQUEST -6
+
+// largest payload of a request: the two ends of a range
+#define BIGBAG_MAX_REQUEST_LEN (2 * 0xFFFFFC)
+
+#pragma pack(1)
+struct bigbag_request_s {
+    uint8_t op;
+    uint32_t len;
+};
+
+struct bigbag_response_s {
+    int8_t status;
+    uint32_t len;
+};
+#pragma pack()
@@ -0,0 +1,2942 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "bigbag.h"
+#include "libbigbag.h"
+#include "libbigbag_lines.h"
+
+/**
+ * An open bag: the mapping moves when the bag grows, so code that can
+ * grow it takes this instead of the header.
+**/
+struct bigbag_s
+{
+    int fd;
+    // name of the file, to follow it when bigbag_compact replaces the file
+    char *filename;
+    // changes are made to a private copy of the file: BIGBAG_PRIVATE
+    // never writes them back, BIGBAG_DURABLE writes them in group commits
+    bool private;
+    struct bigbag_hdr_s *hdr;
+    // bytes mapped at hdr
+    uint64_t size;
+    // BIGBAG_DURABLE only: commit settings and pages changed since the
+    // last commit
+    struct durable_s *durable;
+    // a read-only copy made by bigbag_snapshot, private too
+    bool snapshot;
+};
+
+/**
+ * Group commit state of a bag opened with BIGBAG_DURABLE.
+**/
+struct durable_s
+{
+    int journal_fd;
+    // commit after this many changes or this many ms, 0 for no limit
+    uint32_t commit_ops;
+    uint32_t commit_ms;
+    // changes since the last commit and when the first of them was made
+    uint32_t ops;
+    struct timespec first_op;
+    uint64_t page_size;
+    // one bit per page of the mapping, set by markDirty when the page
+    // is written
+    uint8_t *dirty;
+};
+
+/**
+ * Return the entry at a offset
+**/
+static struct bigbag_entry_s *entry_addr(void *hdr, uint32_t offset)
+{
+    if (offset == 0)
+        return NULL;
+    return (struct bigbag_entry_s *)((char *)hdr + offset);
+}
+
+/**
+ * Return the offset of an entry
+**/
+static uint32_t entry_offset(void *hdr, void *entry)
+{
+    return (uint32_t)((uint64_t)entry - (uint64_t)hdr);
+}
+
+/**
+ * Return true if the bag was created with a lookup index.
+ * Older bags only have the linked list and are searched by walking it.
+ * 
+ * @param {bigbag_hdr_s} hdr - header of the file
+**/
+static bool hasIndex(struct bigbag_hdr_s *hdr)
+{
+    return hdr->magic == BIGBAG_MAGIC_V2;
+}
+
+/**
+ * Return the size of the bag: old bags are always BIGBAG_SIZE.
+ * 
+ * @param {bigbag_hdr_s} hdr - header of the file
+**/
+static uint64_t bagSize(struct bigbag_hdr_s *hdr)
+{
+    return hasIndex(hdr) ? hdr->size : BIGBAG_SIZE;
+}
+
+/**
+ * Return the offset of the first entry in file order.
+ * 
+ * @param {bigbag_hdr_s} hdr - header of the file
+**/
+static uint32_t firstEntryOffset(struct bigbag_hdr_s *hdr)
+{
+    return hasIndex(hdr) ? sizeof(struct bigbag_hdr_s) : sizeof(struct bigbag_hdr_v1_s);
+}
+
+/**
+ * Check that a mapped file can be used as a bag: an old bag with its
+ * magic and all of its BIGBAG_SIZE bytes, or an extended header of a
+ * version this code knows that is not truncated.
+ * Some old bags have the magic in network byte order.
+ * 
+ * @param {bigbag_hdr_s} hdr - header of the file
+ * @param {uint64_t} size - size of the file
+**/
+static bool validBag(struct bigbag_hdr_s *hdr, uint64_t size)
+{
+    if (size < sizeof(hdr->magic))
+        return false;
+    if (hdr->magic == BIGBAG_MAGIC || hdr->magic == htonl(BIGBAG_MAGIC))
+        return size >= BIGBAG_SIZE;
+    if (hdr->magic != BIGBAG_MAGIC_V2)
+        return false;
+    return size >= sizeof(*hdr) && hdr->version >= BIGBAG_MIN_VERSION &&
+           hdr->version <= BIGBAG_VERSION && hdr->size <= size;
+}
+
+/**
+ * Return the slots stored in the index entry.
+ * Entries of indexed bags are 4-byte aligned, so the slots are too.
+ * 
+ * @param {bigbag_hdr_s} hdr - header of the file
+**/
+static struct bigbag_slot_s *indexSlots(struct bigbag_hdr_s *hdr)
+{
+    return (struct bigbag_slot_s *)entry_addr(hdr, hdr->index)->str;
+}
+
+/**
+ * Return the key of a slot for a string: its first BIGBAG_KEY_LEN bytes,
+ * big-endian, zero padded.
+**/
+static uint32_t slotKey(const char *str)
+{
+    uint32_t key = 0;
+    for (int i = 0; i < BIGBAG_KEY_LEN; i++)
+    {
+        key = key << 8 | (unsigned char)*str;
+        if (*str)
+            str++;
+    }
+    return key;
+}
+
+/**
+ * Compare the element of a slot with a string, like strcmp.
+ * Different keys decide without reading the element. So do equal keys
+ * that end in a zero byte: both strings end within the key.
+ * 
+ * @param {bigbag_hdr_s} hdr - header of the file
+ * @param {bigbag_slot_s} slot - slot of the element
+ * @param {char} str - string to compare with
+ * @param {uint32_t} key - slotKey of str
+**/
+static int compareSlot(struct bigbag_hdr_s *hdr, struct bigbag_slot_s *slot, const char *str, uint32_t key)
+{
+    if (slot->key != key)
+        return slot->key < key ? -1 : 1;
+    if ((key & 0xFF) == 0)
+        return 0;
+    const char *stored = entry_addr(hdr, slot->offset)->str;
+    return strcmp(stored + BIGBAG_KEY_LEN, str + BIGBAG_KEY_LEN);
+}
+
+/**
+ * Binary search the index for the first element that is >= element.
+ * Returns hdr->element_count if every element is smaller.
+ * 
+ * @param {bigbag_hdr_s} hdr - header of the file
+ * @param {char} element - element to search for
+**/
+static uint32_t indexLowerBound(struct bigbag_hdr_s *hdr, const char *element)
+{
+    struct bigbag_slot_s *slots = indexSlots(hdr);
+    uint32_t key = slotKey(element);
+    uint32_t lo = 0;
+    uint32_t hi = hdr->element_count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (compareSlot(hdr, &slots[mid], element, key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Return the offset just past an entry.
+ * 
+ * @param {bigbag_hdr_s} hdr - header of the file
+ * @param {bigbag_entry_s} entry - entry to measure
+**/
+static uint32_t entry_end(void *hdr, struct bigbag_entry_s *entry)
+{
+    return entry_offset(hdr, entry) + sizeof(*entry) + entry->entry_len;
+}
+
+/**
+ * Record that len bytes at addr were changed, so a BIGBAG_DURABLE bag
+ * writes the pages they are on with its next group commit. Other bags
+ * change the file through the mapping and have nothing to record.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {void} addr - first byte changed, in the mapping
+ * @param {uint64_t} len - number of bytes changed
+**/
+static void markDirty(struct bigbag_s *bag, const void *addr, uint64_t len)
+{
+    struct durable_s *durable = bag->durable;
+    if (!durable || len == 0)
+        return;
+    uint64_t offset = (const char *)addr - (const char *)bag->hdr;
+    uint64_t last = (offset + len - 1) / durable->page_size;
+    for (uint64_t page = offset / durable->page_size; page <= last; page++)
+        durable->dirty[page / 8] |= 1 << (page % 8);
+}
+
+static void freeEntry(struct bigbag_s *bag, struct bigbag_entry_s *entry);
+static void trackGrowth(struct bigbag_s *bag, void *file_base, uint64_t old_size, uint64_t new_size);
+
+/**
+ * Give the bytes from offset up to end to the free list, in pieces that
+ * fit in entry_len.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {uint64_t} offset - start of the space, not part of any entry
+ * @param {uint64_t} end - end of the space
+**/
+static void freeRange(struct bigbag_s *bag, uint64_t offset, uint64_t end)
+{
+    uint64_t max_piece = sizeof(struct bigbag_entry_s) + BIGBAG_MAX_ENTRY_LEN;
+    while (offset < end)
+    {
+        uint64_t piece = end - offset;
+        if (piece > max_piece)
+            piece = max_piece;
+        // don't leave a rest that is too small to be an entry
+        if (end - offset - piece > 0 && end - offset - piece < MIN_ENTRY_SIZE)
+            piece -= MIN_ENTRY_SIZE;
+        struct bigbag_entry_s *entry = entry_addr(bag->hdr, offset);
+        entry->entry_len = piece - sizeof(*entry);
+        freeEntry(bag, entry);
+        offset += piece;
+    }
+}
+
+/**
+ * Grow the bag so an entry with room for len bytes can be allocated.
+ * Method:
+ * 1. Double the size of the bag until the entry fits, up to BIGBAG_MAX_SIZE
+ * 2. Shared bags: extend the file and move the mapping with mremap
+ *    Private bags: copy the mapping into a bigger anonymous one so the
+ *    file is not touched; BIGBAG_DURABLE extends the file when it commits
+ * 3. Give the new space to the free list (freeRange)
+ * 
+ * Old bags don't record their size and never grow.
+ * Returns false if the bag can't grow.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {uint32_t} len - bytes needed after the entry header
+**/
+static bool growBag(struct bigbag_s *bag, uint32_t len)
+{
+    struct bigbag_hdr_s *hdr = bag->hdr;
+    if (!hasIndex(hdr))
+        return false;
+    uint64_t old_size = hdr->size;
+    uint64_t need = old_size + sizeof(struct bigbag_entry_s) + len + MIN_ENTRY_SIZE;
+    uint64_t new_size = old_size * 2;
+    while (new_size < need)
+        new_size *= 2;
+    if (new_size > BIGBAG_MAX_SIZE)
+        new_size = BIGBAG_MAX_SIZE;
+    if (new_size < need)
+        return false;
+
+    void *file_base;
+    if (bag->private)
+    {
+        file_base = mmap(0, new_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (file_base == MAP_FAILED)
+            return false;
+        memcpy(file_base, hdr, old_size);
+        munmap(hdr, bag->size);
+        if (bag->durable)
+            trackGrowth(bag, file_base, old_size, new_size);
+    }
+    else
+    {
+        if (ftruncate(bag->fd, new_size) == -1)
+            return false;
+        file_base = mremap(hdr, bag->size, new_size, MREMAP_MAYMOVE);
+        if (file_base == MAP_FAILED)
+            return false;
+    }
+    bag->hdr = hdr = file_base;
+    bag->size = new_size;
+    hdr->size = new_size;
+    markDirty(bag, hdr, sizeof(*hdr));
+
+    freeRange(bag, old_size, new_size);
+    return true;
+}
+
+/**
+ * Return the entry_len an entry needs to hold len bytes.
+ * Entries of indexed bags are kept 4-byte aligned.
+ * 
+ * @param {bigbag_hdr_s} hdr - header of the file
+ * @param {uint32_t} len - bytes the entry has to hold
+**/
+static uint32_t entryLen(struct bigbag_hdr_s *hdr, uint32_t len)
+{
+    if (hasIndex(hdr))
+        return (len + 3) & ~3;
+    return len;
+}
+
+/**
+ * Carve a used entry with room for len bytes out of the free list.
+ * The free list starts at hdr->first_free and is kept in file order.
+ * Method:
+ * 1. Walk the free list and pick the smallest entry that fits (best fit)
+ *  - Stop early on an exact fit
+ * 2. If the leftover can still hold an entry, split it off the end and put
+ *    it in the list where the chosen entry was
+ * 3. Otherwise hand out the whole entry and unlink it
+ * 4. Nothing fits: grow the bag (growBag) and try again
+ * 
+ * Returns NULL if the bag is out of space. The bag may have moved, so
+ * entry pointers taken before the call are no longer valid.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {uint32_t} len - bytes needed after the entry header
+**/
+static struct bigbag_entry_s *allocEntry(struct bigbag_s *bag, uint32_t len)
+{
+    struct bigbag_hdr_s *hdr = bag->hdr;
+    struct bigbag_entry_s *best = NULL;
+    struct bigbag_entry_s *best_back = NULL;
+    struct bigbag_entry_s *back = NULL;
+    if (len > BIGBAG_MAX_ENTRY_LEN)
+        return NULL;
+    len = entryLen(hdr, len);
+    for (struct bigbag_entry_s *front = entry_addr(hdr, hdr->first_free); front;
+         back = front, front = entry_addr(hdr, front->next))
+    {
+        if (front->entry_len < len)
+            continue;
+        if (!best || front->entry_len < best->entry_len)
+        {
+            best = front;
+            best_back = back;
+            if (front->entry_len == len)
+                break;
+        }
+    }
+    if (!best)
+    {
+        if (!growBag(bag, len))
+            return NULL;
+        return allocEntry(bag, len);
+    }
+
+    uint32_t rest = best->next;
+    if (best->entry_len >= len + MIN_ENTRY_SIZE)
+    {
+        struct bigbag_entry_s *free_entry = entry_addr(hdr, entry_offset(hdr, best) + sizeof(*best) + len);
+        free_entry->next = best->next;
+        free_entry->entry_magic = BIGBAG_FREE_ENTRY_MAGIC;
+        free_entry->entry_len = best->entry_len - len - sizeof(*best);
+        rest = entry_offset(hdr, free_entry);
+        best->entry_len = len;
+        markDirty(bag, free_entry, sizeof(*free_entry));
+    }
+    if (best_back)
+    {
+        best_back->next = rest;
+        markDirty(bag, best_back, sizeof(*best_back));
+    }
+    else
+    {
+        hdr->first_free = rest;
+        markDirty(bag, hdr, sizeof(*hdr));
+    }
+
+    best->next = 0;
+    best->entry_magic = BIGBAG_USED_ENTRY_MAGIC;
+    // the caller fills in the rest of the entry
+    markDirty(bag, best, sizeof(*best) + best->entry_len);
+    return best;
+}
+
+/**
+ * Return an entry to the free list.
+ * Method:
+ * 1. Walk the free list to the entries before and after it in file order
+ * 2. Merge it into the entry after it if they touch
+ * 3. Merge it into the entry before it if they touch, otherwise link it
+ *    after that entry (or make it hdr->first_free)
+ *  - Entries are only merged while the result fits in entry_len
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {bigbag_entry_s} entry - entry that is no longer used
+**/
+static void freeEntry(struct bigbag_s *bag, struct bigbag_entry_s *entry)
+{
+    struct bigbag_hdr_s *hdr = bag->hdr;
+    uint32_t offset = entry_offset(hdr, entry);
+    struct bigbag_entry_s *back = NULL;
+    struct bigbag_entry_s *front = entry_addr(hdr, hdr->first_free);
+    while (front && entry_offset(hdr, front) < offset)
+    {
+        back = front;
+        front = entry_addr(hdr, front->next);
+    }
+    entry->entry_magic = BIGBAG_FREE_ENTRY_MAGIC;
+    entry->next = front ? entry_offset(hdr, front) : 0;
+    if (front && entry_end(hdr, entry) == entry->next &&
+        entry->entry_len + sizeof(*front) + front->entry_len <= BIGBAG_MAX_ENTRY_LEN)
+    {
+        entry->entry_len += sizeof(*front) + front->entry_len;
+        entry->next = front->next;
+    }
+    markDirty(bag, entry, sizeof(*entry));
+    if (back && entry_end(hdr, back) == offset &&
+        back->entry_len + sizeof(*entry) + entry->entry_len <= BIGBAG_MAX_ENTRY_LEN)
+    {
+        back->entry_len += sizeof(*entry) + entry->entry_len;
+        back->next = entry->next;
+    }
+    else if (back)
+        back->next = offset;
+    else
+        hdr->first_free = offset;
+    if (back)
+        markDirty(bag, back, sizeof(*back));
+    else
+        markDirty(bag, hdr, sizeof(*hdr));
+}
+
+/**
+ * Make sure the index has room for count more slots.
+ * A full index is copied into a new entry at least twice its size and
+ * the old index entry goes back to the free list.
+ * 
+ * Returns false if the bag is out of space.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {uint32_t} count - number of slots about to be added
+**/
+static bool reserveIndexSlots(struct bigbag_s *bag, uint32_t count)
+{
+    struct bigbag_hdr_s *hdr = bag->hdr;
+    struct bigbag_entry_s *index = entry_addr(hdr, hdr->index);
+    uint64_t needed = ((uint64_t)hdr->element_count + count) * sizeof(struct bigbag_slot_s);
+    if (needed <= index->entry_len)
+        return true;
+    uint64_t grown_len = (uint64_t)index->entry_len * 2;
+    while (grown_len < needed)
+        grown_len *= 2;
+    if (grown_len > BIGBAG_MAX_ENTRY_LEN)
+        grown_len = BIGBAG_MAX_ENTRY_LEN;
+    if (needed > grown_len)
+        return false;
+    struct bigbag_entry_s *grown = allocEntry(bag, grown_len);
+    if (!grown)
+        return false;
+    // allocEntry may have moved the bag
+    hdr = bag->hdr;
+    index = entry_addr(hdr, hdr->index);
+    grown->entry_magic = BIGBAG_KEYED_INDEX_ENTRY_MAGIC;
+    memcpy(grown->str, index->str, hdr->element_count * sizeof(struct bigbag_slot_s));
+    hdr->index = entry_offset(hdr, grown);
+    markDirty(bag, hdr, sizeof(*hdr));
+    freeEntry(bag, index);
+    return true;
+}
+
+/**
+ * Rebuild the index of a version 2 or 3 bag, which holds bare offsets,
+ * as a keyed index.
+ * Method:
+ * 1. Allocate an entry with a slot for every offset the old index had
+ *    room for
+ * 2. Fill in the offsets and the keys of their elements
+ * 3. Point hdr->index at it and free the old index
+ * 
+ * Returns false if the bag is out of space; compacting it makes room.
+ * 
+ * @param {bigbag_s} bag - the open bag
+**/
+static bool upgradeIndex(struct bigbag_s *bag)
+{
+    struct bigbag_hdr_s *hdr = bag->hdr;
+    struct bigbag_entry_s *index = entry_addr(hdr, hdr->index);
+    if (index->entry_magic == BIGBAG_KEYED_INDEX_ENTRY_MAGIC)
+        return true;
+    uint64_t len = (uint64_t)index->entry_len / sizeof(uint32_t) * sizeof(struct bigbag_slot_s);
+    if (len > BIGBAG_MAX_ENTRY_LEN)
+        len = BIGBAG_MAX_ENTRY_LEN;
+    if (len < hdr->element_count * sizeof(struct bigbag_slot_s))
+        return false;
+    struct bigbag_entry_s *keyed = allocEntry(bag, len);
+    if (!keyed)
+        return false;
+    // allocEntry may have moved the bag
+    hdr = bag->hdr;
+    index = entry_addr(hdr, hdr->index);
+    keyed->entry_magic = BIGBAG_KEYED_INDEX_ENTRY_MAGIC;
+    uint32_t *offsets = (uint32_t *)index->str;
+    struct bigbag_slot_s *slots = (struct bigbag_slot_s *)keyed->str;
+    for (uint32_t i = 0; i < hdr->element_count; i++)
+    {
+        slots[i].offset = offsets[i];
+        slots[i].key = slotKey(entry_addr(hdr, offsets[i])->str);
+    }
+    hdr->index = entry_offset(hdr, keyed);
+    markDirty(bag, hdr, sizeof(*hdr));
+    freeEntry(bag, index);
+    return true;
+}
+
+/**
+ * Link a new entry into the list and the index of an indexed bag.
+ * Method:
+ * 1. Binary search the index for the insert position
+ * 2. The index entry before that position is the list predecessor
+ *  - No predecessor: the entry becomes hdr->first_element
+ * 3. Insert a slot for the entry into the index
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {bigbag_entry_s} newEntry - entry holding the element
+**/
+static void linkIndexedEntry(struct bigbag_s *bag, struct bigbag_entry_s *newEntry)
+{
+    struct bigbag_hdr_s *hdr = bag->hdr;
+    uint32_t new_offset = entry_offset(hdr, newEntry);
+    uint32_t pos = indexLowerBound(hdr, newEntry->str);
+    struct bigbag_slot_s *slots = indexSlots(hdr);
+    if (pos == 0)
+    {
+        newEntry->next = hdr->first_element;
+        hdr->first_element = new_offset;
+    }
+    else
+    {
+        struct bigbag_entry_s *back = entry_addr(hdr, slots[pos - 1].offset);
+        newEntry->next = back->next;
+        back->next = new_offset;
+        markDirty(bag, back, sizeof(*back));
+    }
+    memmove(&slots[pos + 1], &slots[pos], (hdr->element_count - pos) * sizeof(struct bigbag_slot_s));
+    slots[pos].offset = new_offset;
+    slots[pos].key = slotKey(newEntry->str);
+    markDirty(bag, &slots[pos], (hdr->element_count - pos + 1) * sizeof(struct bigbag_slot_s));
+    hdr->element_count++;
+    markDirty(bag, hdr, sizeof(*hdr));
+}
+
+/**
+ * Add an element to the file. 
+ * Method:
+ * 1. Create a new entry in the file from the free space
+ *  - The bag grows if there is not enough free space; old bags can't
+ *    grow and are full
+ *  - Indexed bags also need room for one more index slot
+ * 2. Indexed bags: find the insert position with the index (linkIndexedEntry)
+ * 3. Other bags: traverse the linked list with 2 runners front and back
+ *  - Corner case #1: Bag is empty
+ *  - Corner case #2: Element should be inserted at the first position
+ *  - Corner case #3: There is a string that matches the element
+ *  - Corner case #4: Element should be inserted at the last position
+ *  - Note: My if statement covers corner case #3
+ * 4. Set the pointer of back to the new entry
+ * 5. Set the new entry next to front's offset
+ * 
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {char} element - element to add to file
+**/
+static int addElement(struct bigbag_s *bag, const char *element)
+{
+    struct bigbag_hdr_s *hdr;
+    struct bigbag_entry_s *newEntry;
+    struct bigbag_entry_s *front;
+    struct bigbag_entry_s *back;
+    if (hasIndex(bag->hdr) && !reserveIndexSlots(bag, 1))
+        return BIGBAG_ERR_FULL;
+    newEntry = allocEntry(bag, strlen(element) + 1);
+    if (!newEntry)
+        return BIGBAG_ERR_FULL;
+    hdr = bag->hdr;
+    strcpy(newEntry->str, element);
+    if (hasIndex(hdr))
+    {
+        linkIndexedEntry(bag, newEntry);
+        return BIGBAG_OK;
+    }
+    uint32_t new_offset = entry_offset(hdr, newEntry);
+    front = entry_addr(hdr, hdr->first_element);
+    back = front;
+    // Resolves corner case #1: Empty bag
+    if (!front)
+    {
+        newEntry->next = hdr->first_element;
+        hdr->first_element = new_offset;
+    }
+
+    while (front)
+    {
+        // element <= front
+        if (strcmp(element, front->str) <= 0)
+        {
+            // Check if this is first element
+            // Corner case #2: Element should be inserted at the first position
+            if (back == front)
+            {
+                newEntry->next = hdr->first_element;
+                hdr->first_element = new_offset;
+            }
+            else
+            {
+                // Set new element next to front
+                newEntry->next = back->next;
+                // Should point to newly inserted element
+                back->next = new_offset;
+            }
+            break;
+        }
+        // Fetch next entry
+        unsigned int nextOffset = front->next;
+        back = front;
+        front = entry_addr(hdr, nextOffset);
+        // Resolves corner case #4: Element is last position
+        if (!front)
+        {
+            newEntry->next = 0;
+            back->next = new_offset;
+            break;
+        }
+    }
+    markDirty(bag, hdr, sizeof(*hdr));
+    if (back)
+        markDirty(bag, back, sizeof(*back));
+    return BIGBAG_OK;
+}
+
+/**
+ * Copy sorted strings into new entries that sit back to back in the file.
+ * Method:
+ * 1. Group as many strings as fit in one entry_len
+ * 2. Allocate one entry for the whole group
+ * 3. Carve it into one entry per string; the last one keeps any slack
+ * 4. Repeat until every string has an entry
+ * 
+ * The offsets of the new entries are stored in offsets. Returns false,
+ * with nothing left allocated, if the bag is out of space.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {char} strings - strings to copy
+ * @param {uint32_t} count - number of strings
+ * @param {uint32_t} offsets - receives the offset of each new entry
+**/
+static bool allocBatch(struct bigbag_s *bag, const char **strings, uint32_t count, uint32_t *offsets)
+{
+    uint32_t done = 0;
+    while (done < count)
+    {
+        // the first entry of the group uses the header of the allocation
+        uint64_t group_len = 0;
+        uint32_t end = done;
+        while (end < count)
+        {
+            uint64_t len = sizeof(struct bigbag_entry_s) + entryLen(bag->hdr, strlen(strings[end]) + 1);
+            if (group_len + len - sizeof(struct bigbag_entry_s) > BIGBAG_MAX_ENTRY_LEN)
+                break;
+            group_len += len;
+            end++;
+        }
+        struct bigbag_entry_s *group = NULL;
+        if (end > done)
+            group = allocEntry(bag, group_len - sizeof(struct bigbag_entry_s));
+        if (!group)
+        {
+            for (uint32_t i = 0; i < done; i++)
+                freeEntry(bag, entry_addr(bag->hdr, offsets[i]));
+            return false;
+        }
+        uint32_t slack = group->entry_len - (group_len - sizeof(*group));
+        uint32_t offset = entry_offset(bag->hdr, group);
+        for (uint32_t i = done; i < end; i++)
+        {
+            struct bigbag_entry_s *entry = entry_addr(bag->hdr, offset);
+            entry->next = 0;
+            entry->entry_magic = BIGBAG_USED_ENTRY_MAGIC;
+            entry->entry_len = entryLen(bag->hdr, strlen(strings[i]) + 1);
+            if (i == end - 1)
+                entry->entry_len += slack;
+            strcpy(entry->str, strings[i]);
+            offsets[i] = offset;
+            offset += sizeof(*entry) + entry->entry_len;
+        }
+        done = end;
+    }
+    return true;
+}
+
+/**
+ * Merge sorted new entries into the list and the index of an indexed bag.
+ * Method:
+ * 1. Merge the index from the back: the last slot is filled with the
+ *    larger of the last old and the last new element, and so on
+ *  - New elements go before equal old ones, like addElement
+ * 2. While merging, link each new entry to the slot after it, and each
+ *    old entry whose successor is new
+ * 3. Stop once every new entry is placed: the old slots before that
+ *    are already where they belong
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {uint32_t} offsets - sorted offsets of the new entries
+ * @param {uint32_t} count - number of new entries
+**/
+static void mergeIndexedEntries(struct bigbag_s *bag, uint32_t *offsets, uint32_t count)
+{
+    struct bigbag_hdr_s *hdr = bag->hdr;
+    if (count == 0)
+        return;
+    struct bigbag_slot_s *slots = indexSlots(hdr);
+    int64_t old = (int64_t)hdr->element_count - 1;
+    int64_t new = (int64_t)count - 1;
+    int64_t pos = (int64_t)hdr->element_count + count - 1;
+    uint32_t next = 0;
+    bool next_is_new = false;
+    char *new_str = entry_addr(hdr, offsets[new])->str;
+    struct bigbag_slot_s new_slot = {offsets[new], slotKey(new_str)};
+    while (new >= 0)
+    {
+        struct bigbag_slot_s slot;
+        bool is_new;
+        if (old >= 0 && compareSlot(hdr, &slots[old], new_str, new_slot.key) >= 0)
+        {
+            slot = slots[old--];
+            is_new = false;
+        }
+        else
+        {
+            slot = new_slot;
+            is_new = true;
+            if (--new >= 0)
+            {
+                new_str = entry_addr(hdr, offsets[new])->str;
+                new_slot.offset = offsets[new];
+                new_slot.key = slotKey(new_str);
+            }
+        }
+        if (is_new || next_is_new)
+        {
+            entry_addr(hdr, slot.offset)->next = next;
+            markDirty(bag, entry_addr(hdr, slot.offset), sizeof(struct bigbag_entry_s));
+        }
+        slots[pos--] = slot;
+        next = slot.offset;
+        next_is_new = is_new;
+    }
+    markDirty(bag, &slots[pos + 1], (hdr->element_count + count - 1 - pos) * sizeof(struct bigbag_slot_s));
+    // the old entry in front of the first placed one may need a new next
+    if (old >= 0 && next_is_new)
+    {
+        entry_addr(hdr, slots[old].offset)->next = next;
+        markDirty(bag, entry_addr(hdr, slots[old].offset), sizeof(struct bigbag_entry_s));
+    }
+    if (old < 0)
+        hdr->first_element = slots[0].offset;
+    hdr->element_count += count;
+    markDirty(bag, hdr, sizeof(*hdr));
+}
+
+/**
+ * Merge sorted new entries into the list of a bag without an index.
+ * Walks the list once with 2 runners, inserting each new entry in front
+ * of the first element that is not smaller.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {uint32_t} offsets - sorted offsets of the new entries
+ * @param {uint32_t} count - number of new entries
+**/
+static void mergeEntries(struct bigbag_s *bag, uint32_t *offsets, uint32_t count)
+{
+    struct bigbag_hdr_s *hdr = bag->hdr;
+    struct bigbag_entry_s *back = NULL;
+    struct bigbag_entry_s *front = entry_addr(hdr, hdr->first_element);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        struct bigbag_entry_s *newEntry = entry_addr(hdr, offsets[i]);
+        while (front && strcmp(front->str, newEntry->str) < 0)
+        {
+            back = front;
+            front = entry_addr(hdr, front->next);
+        }
+        newEntry->next = front ? entry_offset(hdr, front) : 0;
+        if (back)
+        {
+            back->next = offsets[i];
+            markDirty(bag, back, sizeof(*back));
+        }
+        else
+        {
+            hdr->first_element = offsets[i];
+            markDirty(bag, hdr, sizeof(*hdr));
+        }
+        back = newEntry;
+    }
+}
+
+/**
+ * Compare two strings for qsort
+**/
+static int compareStrings(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/**
+ * Add sorted elements to the bag at once.
+ * Method:
+ * 1. Make room in the index, then copy the elements into entries that
+ *    sit back to back (allocBatch)
+ * 2. Merge the new entries into the list in one pass
+ * 
+ * Either every element is added or, if the bag is out of space, none is.
+ * Returns BIGBAG_ERR_IO, with the bag untouched, if there is no memory
+ * for the offsets.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {char} elements - elements to add, sorted
+ * @param {uint32_t} count - number of elements
+**/
+static int addBatch(struct bigbag_s *bag, const char **elements, uint32_t count)
+{
+    uint32_t *offsets = malloc((count + 1) * sizeof(uint32_t));
+    if (!offsets)
+        return BIGBAG_ERR_IO;
+    int status = BIGBAG_ERR_FULL;
+    if ((!hasIndex(bag->hdr) || reserveIndexSlots(bag, count)) &&
+        allocBatch(bag, elements, count, offsets))
+    {
+        if (hasIndex(bag->hdr))
+            mergeIndexedEntries(bag, offsets, count);
+        else
+            mergeEntries(bag, offsets, count);
+        status = BIGBAG_OK;
+    }
+    free(offsets);
+    return status;
+}
+
+/**
+ * Read the rest of a stream onto the end of a buffer, which is kept
+ * zero terminated. Reads until end of file rather than the size of the
+ * file, so pipes and standard input work too.
+ * Returns false, with errno set, if reading fails or the buffer can't
+ * grow; *data is still the caller's to free then.
+ * 
+ * @param {FILE} fh - stream to read
+ * @param {char} data - the malloc'd buffer or NULL, moves as it grows
+ * @param {size_t} size - bytes in the buffer, grows by the bytes read
+**/
+static bool readRest(FILE *fh, char **data, size_t *size)
+{
+    size_t capacity = *size + 65536;
+    for (;;)
+    {
+        char *grown = realloc(*data, capacity + 1);
+        if (!grown)
+            return false;
+        *data = grown;
+        *size += fread(*data + *size, 1, capacity - *size, fh);
+        if (*size < capacity)
+            break;
+        capacity *= 2;
+    }
+    (*data)[*size] = 0;
+    return !ferror(fh);
+}
+
+/**
+ * Split a buffer into lines in place; empty lines are skipped.
+ * The lines point into data. Returns NULL, with errno set, if there is
+ * no memory for them.
+ * 
+ * @param {char} data - the buffer
+ * @param {size_t} size - bytes in the buffer
+ * @param {uint32_t} count - receives the number of lines
+**/
+static const char **splitLines(char *data, size_t size, uint32_t *count)
+{
+    uint32_t capacity = 1024;
+    const char **lines = malloc(capacity * sizeof(char *));
+    *count = 0;
+    for (char *line = data; lines && line < data + size;)
+    {
+        char *end = memchr(line, '\n', data + size - line);
+        if (end)
+            *end = 0;
+        else
+            end = data + size;
+        if (*line)
+        {
+            if (*count == capacity)
+            {
+                capacity *= 2;
+                const char **grown = realloc(lines, capacity * sizeof(char *));
+                if (!grown)
+                {
+                    free(lines);
+                    return NULL;
+                }
+                lines = grown;
+            }
+            lines[(*count)++] = line;
+        }
+        line = end + 1;
+    }
+    return lines;
+}
+
+/**
+ * Read a whole file and split it into lines; empty lines are skipped.
+ * The lines point into *data, which the caller frees along with them.
+ * Returns NULL, with errno set, if the file can't be read or there is
+ * no memory for it.
+ * Also used by bigbag_shards_add_file.
+ * 
+ * @param {char} filename - file to read
+ * @param {char} data - receives the contents of the file
+ * @param {uint32_t} count - receives the number of lines
+**/
+const char **bigbag_read_lines(const char *filename, char **data, uint32_t *count)
+{
+    FILE *fh = fopen(filename, "r");
+    if (fh == NULL)
+        return NULL;
+    *data = NULL;
+    size_t size = 0;
+    bool ok = readRest(fh, data, &size);
+    int error = errno;
+    fclose(fh);
+    const char **lines = ok ? splitLines(*data, size, count) : NULL;
+    if (!ok)
+        errno = error;
+    if (!lines)
+        free(*data);
+    return lines;
+}
+
+/**
+ * Map the rest of the file if another process grew the bag.
+ * 
+ * @param {bigbag_s} bag - the open bag
+**/
+static void remapIfGrown(struct bigbag_s *bag)
+{
+    if (bag->private || !hasIndex(bag->hdr))
+        return;
+    uint64_t size = __atomic_load_n(&bag->hdr->size, __ATOMIC_ACQUIRE);
+    if (size <= bag->size)
+        return;
+    void *file_base = mremap(bag->hdr, bag->size, size, MREMAP_MAYMOVE);
+    if (file_base == MAP_FAILED)
+        return;
+    bag->hdr = file_base;
+    bag->size = size;
+}
+
+/**
+ * Return true if a file name still leads to an open file. A name that
+ * leads nowhere counts as the same file: there is nothing to move to.
+ * 
+ * @param {char} filename - name the file was opened by
+ * @param {int} fd - the open file
+**/
+static bool namesFile(const char *filename, int fd)
+{
+    struct stat named, opened;
+    if (stat(filename, &named) == -1 || fstat(fd, &opened) == -1)
+        return true;
+    return named.st_dev == opened.st_dev && named.st_ino == opened.st_ino;
+}
+
+/**
+ * Return true if bigbag_compact renamed another file over the bag.
+ * Bags with an index are only looked up by name once the compaction
+ * marked them moved; old bags have no room for the mark and are looked
+ * up every time they are locked.
+ * 
+ * @param {bigbag_s} bag - the open bag
+**/
+static bool bagMoved(struct bigbag_s *bag)
+{
+    if (hasIndex(bag->hdr) && !__atomic_load_n(&bag->hdr->moved, __ATOMIC_ACQUIRE))
+        return false;
+    return !namesFile(bag->filename, bag->fd);
+}
+
+/**
+ * Switch a bag over to the file its name leads to now.
+ * Returns false, keeping the old file, if the new one can't be mapped.
+ * 
+ * @param {bigbag_s} bag - the open bag
+**/
+static bool reopenBag(struct bigbag_s *bag)
+{
+    int fd = open(bag->filename, O_RDWR);
+    if (fd == -1)
+        return false;
+    struct stat stat;
+    void *file_base = MAP_FAILED;
+    if (fstat(fd, &stat) == 0 && stat.st_size > 0)
+        file_base = mmap(0, stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (file_base != MAP_FAILED && !validBag(file_base, stat.st_size))
+    {
+        munmap(file_base, stat.st_size);
+        file_base = MAP_FAILED;
+        errno = EINVAL;
+    }
+    if (file_base == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+    munmap(bag->hdr, bag->size);
+    close(bag->fd);
+    bag->fd = fd;
+    bag->hdr = file_base;
+    bag->size = stat.st_size;
+    return true;
+}
+
+/**
+ * Take or release the writer lock of a bag file (BIGBAG_WRITER_LOCK).
+ * Always taken before the flock of the file, never while holding it
+ * (tryWriterLock can be).
+ * 
+ * @param {int} fd - the bag file
+ * @param {short} type - F_WRLCK or F_UNLCK
+**/
+static void writerLock(int fd, short type)
+{
+    struct flock lock = {.l_type = type, .l_whence = SEEK_SET, .l_start = BIGBAG_WRITER_LOCK, .l_len = 1};
+    while (fcntl(fd, F_OFD_SETLKW, &lock) == -1 && errno == EINTR)
+        ;
+}
+
+/**
+ * Take the writer lock of a bag file if no one holds it, without waiting,
+ * so it can be taken while holding the flock. Returns false if another
+ * process holds it.
+ * 
+ * @param {int} fd - the bag file
+**/
+static bool tryWriterLock(int fd)
+{
+    struct flock lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = BIGBAG_WRITER_LOCK, .l_len = 1};
+    int result;
+    while ((result = fcntl(fd, F_OFD_SETLK, &lock)) == -1 && errno == EINTR)
+        ;
+    return result == 0;
+}
+
+/**
+ * Take the flock of a shared bag, moving to the new file first if
+ * bigbag_compact replaced the old one, and map what others added.
+ * LOCK_EX takes the writer lock first.
+ * Returns false, without the locks, if the new file can't be opened.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {int} operation - LOCK_EX or LOCK_SH
+**/
+static bool lockBag(struct bigbag_s *bag, int operation)
+{
+    if (operation == LOCK_EX)
+        writerLock(bag->fd, F_WRLCK);
+    flock(bag->fd, operation);
+    while (bagMoved(bag))
+    {
+        flock(bag->fd, LOCK_UN);
+        if (operation == LOCK_EX)
+            writerLock(bag->fd, F_UNLCK);
+        if (!reopenBag(bag))
+            return false;
+        if (operation == LOCK_EX)
+            writerLock(bag->fd, F_WRLCK);
+        flock(bag->fd, operation);
+    }
+    // left by a compaction that died before its rename
+    if (operation == LOCK_EX && hasIndex(bag->hdr) && bag->hdr->moved)
+        __atomic_store_n(&bag->hdr->moved, 0, __ATOMIC_RELEASE);
+    remapIfGrown(bag);
+    return true;
+}
+
+/**
+ * Take the writer lock and mark the bag as being changed.
+ * Writers in different processes take turns on the writer lock and hold
+ * the flock of the file while they change it.
+ * Readers don't lock: they watch hdr->seq instead (readBag).
+ * Returns false if the bag was compacted and the new file can't be opened.
+ * 
+ * @param {bigbag_s} bag - the open bag
+**/
+static bool beginWrite(struct bigbag_s *bag)
+{
+    if (bag->private)
+        return true;
+    if (!lockBag(bag, LOCK_EX))
+        return false;
+    if (hasIndex(bag->hdr))
+    {
+        // odd means a writer died halfway; its change is all we have
+        uint32_t seq = (bag->hdr->seq + 1) & ~1u;
+        __atomic_store_n(&bag->hdr->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    return true;
+}
+
+/**
+ * Mark the bag as consistent again and release the writer lock.
+ * 
+ * @param {bigbag_s} bag - the open bag
+**/
+static void endWrite(struct bigbag_s *bag)
+{
+    if (bag->private)
+        return;
+    if (hasIndex(bag->hdr))
+        __atomic_store_n(&bag->hdr->seq, bag->hdr->seq + 1, __ATOMIC_RELEASE);
+    flock(bag->fd, LOCK_UN);
+    writerLock(bag->fd, F_UNLCK);
+}
+
+// lock-free attempts before a reader waits for the writers instead
+#define READ_ATTEMPTS 64
+
+/**
+ * Reads the bag on behalf of readBag. Returns false if it ran into
+ * something a writer left half done.
+**/
+typedef bool (*bag_reader_f)(struct bigbag_hdr_s *hdr, uint64_t size, void *arg);
+
+/**
+ * Run a reader on a consistent view of a shared bag without locking it.
+ * Method:
+ * 1. Wait for hdr->seq to be even: no writer is in the middle of a change
+ * 2. Run the reader
+ * 3. If hdr->seq is still the same, nothing changed under the reader
+ * 4. Otherwise try again, up to READ_ATTEMPTS times
+ * 
+ * Returns false if no run saw a consistent bag, right away for old bags
+ * which have no hdr->seq or once bigbag_compact marked the bag moved.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {bag_reader_f} reader - function that reads the bag
+ * @param {void} arg - passed to reader
+**/
+static bool readUnlocked(struct bigbag_s *bag, bag_reader_f reader, void *arg)
+{
+    for (int attempt = 0; hasIndex(bag->hdr) && !__atomic_load_n(&bag->hdr->moved, __ATOMIC_ACQUIRE) &&
+                          attempt < READ_ATTEMPTS;
+         attempt++)
+    {
+        uint32_t seq = __atomic_load_n(&bag->hdr->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        remapIfGrown(bag);
+        bool ok = reader(bag->hdr, bag->size, arg);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (ok && __atomic_load_n(&bag->hdr->seq, __ATOMIC_RELAXED) == seq)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Run a reader on a consistent view of the bag: without the lock if
+ * readUnlocked gets one, otherwise with the lock taken shared (lockBag).
+ * That waits for a change or a commit being written, not for a durable
+ * bag to close.
+ * 
+ * Returns what the last run of the reader returned, false if the bag
+ * moved to a file that can't be opened.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {bag_reader_f} reader - function that reads the bag
+ * @param {void} arg - passed to reader
+**/
+static bool readBag(struct bigbag_s *bag, bag_reader_f reader, void *arg)
+{
+    if (bag->private)
+        return reader(bag->hdr, bag->size, arg);
+    if (readUnlocked(bag, reader, arg))
+        return true;
+    if (!lockBag(bag, LOCK_SH))
+        return false;
+    bool ok = reader(bag->hdr, bag->size, arg);
+    flock(bag->fd, LOCK_UN);
+    return ok;
+}
+
+/**
+ * Return the string of the entry at offset for a reader.
+ * A racing writer can leave offsets and strings half written, so this
+ * returns NULL for anything that would read outside the mapping.
+ * 
+ * @param {bigbag_hdr_s} hdr - header of the file
+ * @param {uint64_t} size - bytes mapped at hdr
+ * @param {uint32_t} offset - offset of the entry
+**/
+static char *readerStr(struct bigbag_hdr_s *hdr, uint64_t size, uint32_t offset)
+{
+    if (offset == 0 || offset + sizeof(struct bigbag_entry_s) >= size)
+        return NULL;
+    struct bigbag_entry_s *entry = entry_addr(hdr, offset);
+    if (!memchr(entry->str, 0, size - offset - sizeof(*entry)))
+        return NULL;
+    return entry->str;
+}
+
+/**
+ * The index as a reader found it. hdr->index and hdr->element_count are
+ * loaded once and checked against the mapping: a writer that moves or
+ * grows the index afterwards can only make the read inconsistent, which
+ * readBag catches, not send it outside the mapping.
+**/
+struct reader_index_s
+{
+    struct bigbag_slot_s *slots;
+    uint32_t count;
+};
+
+/**
+ * Load the index of an indexed bag for a reader.
+ * Returns false if it doesn't fit in the mapping, which a writer can
+ * leave half done.
+ * 
+ * @param {bigbag_hdr_s} hdr - header of the file
+ * @param {uint64_t} size - bytes mapped at hdr
+ * @param {reader_index_s} index - receives the slots and their number
+**/
+static bool readerIndex(struct bigbag_hdr_s *hdr, uint64_t size, struct reader_index_s *index)
+{
+    uint32_t offset = __atomic_load_n(&hdr->index, __ATOMIC_RELAXED);
+    uint32_t count = __atomic_load_n(&hdr->element_count, __ATOMIC_RELAXED);
+    if (offset == 0 ||
+        (uint64_t)offset + sizeof(struct bigbag_entry_s) + (uint64_t)count * sizeof(struct bigbag_slot_s) > size)
+        return false;
+    index->slots = (struct bigbag_slot_s *)entry_addr(hdr, offset)->str;
+    index->count = count;
+    return true;
+}
+
+/**
+ * indexLowerBound for readers: searches the index loaded by readerIndex
+ * and checks every offset it follows.
+ * Returns false if it ran into something a writer left half done.
+ * 
+ * @param {bigbag_hdr_s} hdr - header of the file
+ * @param {uint64_t} size - bytes mapped at hdr
+ * @param {reader_index_s} index - the index from readerIndex
+ * @param {char} element - element to search for
+ * @param {uint32_t} pos - receives the position of the first element >= element
+**/
+static bool readerLowerBound(struct bigbag_hdr_s *hdr, uint64_t size, struct reader_index_s *index,
+                             const char *element, uint32_t *pos)
+{
+    uint32_t key = slotKey(element);
+    uint32_t lo = 0;
+    uint32_t hi = index->count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp;
+        struct bigbag_slot_s slot = index->slots[mid];
+        if (slot.key != key || (key & 0xFF) == 0)
+        {
+            cmp = slot.key < key ? -1 : slot.key > key;
+        }
+        else
+        {
+            // the element is only read when the keys can't decide
+            char *str = readerStr(hdr, size, slot.offset);
+            if (!str || strnlen(str, BIGBAG_KEY_LEN) < BIGBAG_KEY_LEN)
+                return false;
+            cmp = strcmp(str + BIGBAG_KEY_LEN, element + BIGBAG_KEY_LEN);
+        }
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *pos = lo;
+    return true;
+}
+
+/**
+ * Output of a reader, kept until the read is known to be consistent.
+**/
+struct read_buf_s
+{
+    char *data;
+    size_t len;
+    size_t cap;
+    // out of memory while appending
+    bool failed;
+};
+
+/**
+ * Append a string, with its terminator, to a reader's output.
+ * Returns false, with buf->failed set, if the output can't grow.
+ * 
+ * @param {read_buf_s} buf - output of the reader
+ * @param {char} str - string to append
+**/
+static bool appendString(struct read_buf_s *buf, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    if (buf->len + len > buf->cap)
+    {
+        size_t cap = (buf->len + len) * 2;
+        char *data = realloc(buf->data, cap);
+        if (!data)
+        {
+            buf->failed = true;
+            return false;
+        }
+        buf->data = data;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+    return true;
+}
+
+/**
+ * Call visit for each string in a reader's output until it returns false.
+ * 
+ * @param {read_buf_s} buf - output of the reader
+ * @param {bigbag_visit_f} visit - called for each string
+ * @param {void} arg - passed to visit
+**/
+static void visitStrings(struct read_buf_s *buf, bigbag_visit_f visit, void *arg)
+{
+    for (size_t pos = 0; pos < buf->len; pos += strlen(buf->data + pos) + 1)
+        if (!visit(buf->data + pos, arg))
+            break;
+}
+
+/**
+ * Elements for rangeReader to collect: lo <= element <= hi, or the
+ * elements starting with lo if prefix is set. NULL bounds are open.
+**/
+struct range_s
+{
+    const char *lo;
+    const char *hi;
+    bool prefix;
+    struct read_buf_s out;
+};
+
+/**
+ * Return true if str, which is >= range->lo, is past the end of the range.
+**/
+static bool pastRange(struct range_s *range, const char *str)
+{
+    if (range->prefix)
+        return strncmp(str, range->lo, strlen(range->lo)) != 0;
+    return range->hi && strcmp(str, range->hi) > 0;
+}
+
+/**
+ * Reader for bigbag_foreach and friends: copy the elements of the
+ * range_s in arg, in list order, to its read_buf_s.
+ * Method:
+ * 1. Find the first element >= lo: indexed bags binary search the index,
+ *    other bags walk the list up to it
+ * 2. Follow the list from there until an element is past the range
+ * 
+ * Indexed bags only touch the elements they return.
+**/
+static bool rangeReader(struct bigbag_hdr_s *hdr, uint64_t size, void *arg)
+{
+    struct range_s *range = arg;
+    // a list longer than this can only be a cycle
+    uint64_t hops = size / sizeof(struct bigbag_entry_s);
+    range->out.len = 0;
+    range->out.failed = false;
+    uint32_t offset = hdr->first_element;
+    if (range->lo && hasIndex(hdr))
+    {
+        struct reader_index_s index;
+        uint32_t pos;
+        if (!readerIndex(hdr, size, &index) || !readerLowerBound(hdr, size, &index, range->lo, &pos))
+            return false;
+        offset = pos < index.count ? index.slots[pos].offset : 0;
+    }
+    for (; offset; offset = entry_addr(hdr, offset)->next)
+    {
+        char *str = readerStr(hdr, size, offset);
+        if (!str || hops-- == 0)
+            return false;
+        if (range->lo && strcmp(str, range->lo) < 0)
+            continue;
+        if (pastRange(range, str))
+            break;
+        // a retry wouldn't have more memory: the read is done
+        if (!appendString(&range->out, str))
+            break;
+    }
+    return true;
+}
+
+/**
+ * Element to look for and whether findReader found it.
+**/
+struct find_s
+{
+    const char *element;
+    bool found;
+};
+
+/**
+ * Reader for bigbag_check: look up the element in the find_s in arg.
+ * Indexed bags are binary searched; other bags walk the list.
+**/
+static bool findReader(struct bigbag_hdr_s *hdr, uint64_t size, void *arg)
+{
+    struct find_s *find = arg;
+    find->found = false;
+    if (hasIndex(hdr))
+    {
+        struct reader_index_s index;
+        uint32_t pos;
+        if (!readerIndex(hdr, size, &index) || !readerLowerBound(hdr, size, &index, find->element, &pos))
+            return false;
+        if (pos < index.count)
+        {
+            char *str = readerStr(hdr, size, index.slots[pos].offset);
+            if (!str)
+                return false;
+            find->found = strcmp(str, find->element) == 0;
+        }
+        return true;
+    }
+    uint64_t hops = size / sizeof(struct bigbag_entry_s);
+    for (uint32_t offset = hdr->first_element; offset; offset = entry_addr(hdr, offset)->next)
+    {
+        char *str = readerStr(hdr, size, offset);
+        if (!str || hops-- == 0)
+            return false;
+        if (strcmp(str, find->element) == 0)
+        {
+            find->found = true;
+            break;
+        }
+    }
+    return true;
+}
+
+/**
+ * Unlink an element from the list and the index of an indexed bag.
+ * Method:
+ * 1. Binary search the index for the first entry equal to element
+ * 2. The index entry before it is the list predecessor
+ *  - No predecessor: hdr->first_element moves to the next element
+ * 3. Free the entry and remove its slot from the index
+ * 
+ * Returns false if the element is not in the bag.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {char} element - element to remove
+**/
+static bool removeIndexedEntry(struct bigbag_s *bag, const char *element)
+{
+    struct bigbag_hdr_s *hdr = bag->hdr;
+    uint32_t pos = indexLowerBound(hdr, element);
+    struct bigbag_slot_s *slots = indexSlots(hdr);
+    if (pos == hdr->element_count)
+        return false;
+    struct bigbag_entry_s *front = entry_addr(hdr, slots[pos].offset);
+    if (slots[pos].key != slotKey(element) || strcmp(front->str, element) != 0)
+        return false;
+    if (pos == 0)
+        hdr->first_element = front->next;
+    else
+    {
+        entry_addr(hdr, slots[pos - 1].offset)->next = front->next;
+        markDirty(bag, entry_addr(hdr, slots[pos - 1].offset), sizeof(struct bigbag_entry_s));
+    }
+    freeEntry(bag, front);
+    memmove(&slots[pos], &slots[pos + 1], (hdr->element_count - pos - 1) * sizeof(struct bigbag_slot_s));
+    markDirty(bag, &slots[pos], (hdr->element_count - pos - 1) * sizeof(struct bigbag_slot_s));
+    hdr->element_count--;
+    markDirty(bag, hdr, sizeof(*hdr));
+    return true;
+}
+
+/**
+ * Remove an element from the file.
+ * Method:
+ * 1. Indexed bags: use removeIndexedEntry instead of steps 2-3
+ * 2. Use the 2 runner algorithm to determine the position of the element
+ * 2. If front equals element, we have found the element to remove
+ *  - Corner case #1: Remove the first element
+ *  - Corner case #2: Remove the last element
+ *  - Corner case #3: Element not in list
+ *  - Note: My loop covers corner case #2
+ * 3. Remove the element
+ *  - Point back->next to front->next
+ *  - Return front to the free list (freeEntry)
+ * 
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {char} element - element to remove
+ * @return BIGBAG_OK or BIGBAG_ERR_NOT_FOUND
+**/
+static int deleteElement(struct bigbag_s *bag, const char *element)
+{
+    struct bigbag_hdr_s *hdr = bag->hdr;
+    struct bigbag_entry_s *front, *back;
+    if (hasIndex(hdr))
+        return removeIndexedEntry(bag, element) ? BIGBAG_OK : BIGBAG_ERR_NOT_FOUND;
+    front = entry_addr(hdr, hdr->first_element);
+    back = front;
+    while (front)
+    {
+        // Front and element are equlivalent
+        if (strcmp(element, front->str) == 0)
+        {
+            // Resolves corner case #1: Remove first element
+            if (back == front)
+            {
+                // point the first free space to the next element
+                hdr->first_element = front->next;
+                markDirty(bag, hdr, sizeof(*hdr));
+            }
+            else
+            {
+                back->next = front->next;
+                markDirty(bag, back, sizeof(*back));
+            }
+            // Give front back to the free list
+            freeEntry(bag, front);
+            break;
+        }
+        // fetch next entry
+        unsigned int nextOffset = front->next;
+        back = front;
+        front = entry_addr(hdr, nextOffset);
+    }
+    // Resolves corner case #3: element not in list
+    return front ? BIGBAG_OK : BIGBAG_ERR_NOT_FOUND;
+}
+
+/**
+ * Return true if a page was written since the last commit.
+**/
+static bool pageDirty(struct durable_s *durable, uint64_t page)
+{
+    return durable->dirty[page / 8] & (1 << (page % 8));
+}
+
+/**
+ * Make room for the pages of a BIGBAG_DURABLE bag that growBag copied to
+ * a bigger mapping.
+ * The new space is dirty, the rest keeps its state.
+ * 
+ * @param {bigbag_s} bag - the open bag, not yet updated by growBag
+ * @param {void} file_base - the new mapping
+ * @param {uint64_t} old_size - size of the bag before growing
+ * @param {uint64_t} new_size - size of the bag after growing
+**/
+static void trackGrowth(struct bigbag_s *bag, void *file_base, uint64_t old_size, uint64_t new_size)
+{
+    struct durable_s *durable = bag->durable;
+    uint64_t old_bytes = (bag->size / durable->page_size + 7) / 8;
+    uint64_t new_bytes = (new_size / durable->page_size + 7) / 8;
+    durable->dirty = realloc(durable->dirty, new_bytes);
+    memset(durable->dirty + old_bytes, 0, new_bytes - old_bytes);
+    bag->hdr = file_base;
+    bag->size = new_size;
+    markDirty(bag, (char *)file_base + old_size, new_size - old_size);
+}
+
+/**
+ * FNV-1a hash, used as the journal checksum.
+**/
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+/**
+ * Return the name of the journal of a bag file.
+**/
+static char *journalName(const char *filename)
+{
+    char *name = malloc(strlen(filename) + sizeof(".journal"));
+    sprintf(name, "%s.journal", filename);
+    return name;
+}
+
+/**
+ * Finish a group commit that was cut short by a crash.
+ * Method:
+ * 1. Read <bagfile>.journal, if there is one
+ * 2. If it is complete (checksum matches), write its pages into the bag
+ *    and sync it; otherwise the crash came before the commit touched the
+ *    bag, and the journal is dropped
+ *  - Like commitBag, an odd hdr->seq goes to the file first and the
+ *    header page, with its even hdr->seq, last, so lock-free readers
+ *    never take a half written bag for a consistent one
+ * 3. Empty the journal
+ * 
+ * Returns false if the journal can't be applied.
+ * 
+ * @param {char} filename - name of the bag file
+ * @param {int} fd - the bag file; the caller holds its flock and the
+ *                   writer lock, so no durable bag is committing to it
+**/
+static bool recoverJournal(const char *filename, int fd)
+{
+    char *name = journalName(filename);
+    int journal_fd = open(name, O_RDWR);
+    free(name);
+    if (journal_fd == -1)
+        return true;
+    struct stat stat;
+    fstat(journal_fd, &stat);
+    bool ok = true;
+    struct bigbag_journal_s journal;
+    if (stat.st_size >= (off_t)sizeof(journal) && pread(journal_fd, &journal, sizeof(journal), 0) == sizeof(journal) &&
+        journal.magic == BIGBAG_JOURNAL_MAGIC && journal.page_size >= sizeof(struct bigbag_hdr_s))
+    {
+        uint64_t record_len = sizeof(uint64_t) + journal.page_size;
+        uint64_t len = journal.pages * record_len;
+        char *records = malloc(len);
+        if (records && stat.st_size == (off_t)(sizeof(journal) + len) &&
+            pread(journal_fd, records, len, sizeof(journal)) == (ssize_t)len &&
+            fnv1a(0xcbf29ce484222325ULL, records, len) == journal.checksum)
+        {
+            // the header page, written last
+            char *header = NULL;
+            for (uint32_t i = 0; i < journal.pages; i++)
+            {
+                uint64_t offset;
+                memcpy(&offset, records + i * record_len, sizeof(offset));
+                if (offset == 0)
+                    header = records + i * record_len + sizeof(offset);
+            }
+            ok = ftruncate(fd, journal.size) == 0;
+            if (ok && header && hasIndex((struct bigbag_hdr_s *)header))
+            {
+                uint32_t seq = ((struct bigbag_hdr_s *)header)->seq - 1;
+                ok = pwrite(fd, &seq, sizeof(seq), offsetof(struct bigbag_hdr_s, seq)) == sizeof(seq);
+            }
+            for (uint32_t i = 0; ok && i < journal.pages; i++)
+            {
+                uint64_t offset;
+                memcpy(&offset, records + i * record_len, sizeof(offset));
+                if (offset != 0)
+                    ok = pwrite(fd, records + i * record_len + sizeof(offset), journal.page_size, offset) ==
+                         journal.page_size;
+            }
+            if (ok && header)
+                ok = pwrite(fd, header, journal.page_size, 0) == journal.page_size;
+            ok = ok && fdatasync(fd) == 0;
+        }
+        else if (!records)
+        {
+            ok = false;
+        }
+        free(records);
+    }
+    if (ok)
+        ok = ftruncate(journal_fd, 0) == 0;
+    close(journal_fd);
+    return ok;
+}
+
+/**
+ * Write the changes since the last commit to the bag file, all or nothing.
+ * Method:
+ * 1. Collect the dirty pages, the header page last
+ * 2. Write them to the journal and sync it: from here on a crash is
+ *    finished by recoverJournal
+ * 3. Take the flock and tell lock-free readers a change is coming (odd
+ *    hdr->seq in the file)
+ * 4. Write the pages into the bag, header last, sync it and release the
+ *    flock
+ * 5. Empty the journal and start over with every page clean
+ * 
+ * Returns false if a write fails; the journal still has the commit then.
+ * 
+ * @param {bigbag_s} bag - the open bag
+**/
+static bool commitBag(struct bigbag_s *bag)
+{
+    struct durable_s *durable = bag->durable;
+    uint64_t pages = bag->size / durable->page_size;
+    uint32_t count = 0;
+    uint64_t *order = malloc(pages * sizeof(uint64_t));
+    for (uint64_t page = 1; page < pages; page++)
+        if (pageDirty(durable, page))
+            order[count++] = page;
+    if (count == 0 && !pageDirty(durable, 0))
+    {
+        free(order);
+        durable->ops = 0;
+        return true;
+    }
+    order[count++] = 0;
+    if (hasIndex(bag->hdr))
+        bag->hdr->seq += 2;
+
+    struct bigbag_journal_s journal = {BIGBAG_JOURNAL_MAGIC, durable->page_size, count, bagSize(bag->hdr), 0};
+    uint64_t record_len = sizeof(uint64_t) + durable->page_size;
+    char *records = malloc(count * record_len);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint64_t offset = order[i] * durable->page_size;
+        memcpy(records + i * record_len, &offset, sizeof(offset));
+        memcpy(records + i * record_len + sizeof(offset), (char *)bag->hdr + offset, durable->page_size);
+    }
+    journal.checksum = fnv1a(0xcbf29ce484222325ULL, records, count * record_len);
+    bool ok = ftruncate(durable->journal_fd, 0) == 0 &&
+              pwrite(durable->journal_fd, &journal, sizeof(journal), 0) == sizeof(journal) &&
+              pwrite(durable->journal_fd, records, count * record_len, sizeof(journal)) ==
+                  (ssize_t)(count * record_len) &&
+              fdatasync(durable->journal_fd) == 0;
+
+    // readers that take the flock (old bags, bigbag_stats) only wait
+    // while the bag file is written, not between commits
+    flock(bag->fd, LOCK_EX);
+    if (ok && hasIndex(bag->hdr))
+    {
+        uint32_t seq = bag->hdr->seq - 1;
+        ok = pwrite(bag->fd, &seq, sizeof(seq), offsetof(struct bigbag_hdr_s, seq)) == sizeof(seq);
+    }
+    ok = ok && ftruncate(bag->fd, journal.size) == 0;
+    for (uint32_t i = 0; ok && i < count; i++)
+    {
+        uint64_t offset = order[i] * durable->page_size;
+        ok = pwrite(bag->fd, (char *)bag->hdr + offset, durable->page_size, offset) == (ssize_t)durable->page_size;
+    }
+    ok = ok && fdatasync(bag->fd) == 0;
+    flock(bag->fd, LOCK_UN);
+    ok = ok && ftruncate(durable->journal_fd, 0) == 0;
+    free(records);
+    free(order);
+    if (!ok)
+        return false;
+
+    memset(durable->dirty, 0, (pages + 7) / 8);
+    durable->ops = 0;
+    return true;
+}
+
+/**
+ * Count a change and commit once the commit_ops or commit_ms limit is
+ * reached. The time limit is checked as changes come in, not in between.
+ * 
+ * @param {bigbag_s} bag - the open bag
+**/
+static bool maybeCommit(struct bigbag_s *bag)
+{
+    struct durable_s *durable = bag->durable;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (durable->ops++ == 0)
+        durable->first_op = now;
+    uint64_t ms = (now.tv_sec - durable->first_op.tv_sec) * 1000 +
+                  (now.tv_nsec - durable->first_op.tv_nsec) / 1000000;
+    if ((durable->commit_ops && durable->ops >= durable->commit_ops) ||
+        (durable->commit_ms && ms >= durable->commit_ms))
+        return commitBag(bag);
+    return true;
+}
+
+/**
+ * Set up group commits for a bag opened with BIGBAG_DURABLE.
+ * The caller holds the writer lock (BIGBAG_WRITER_LOCK) for as long as
+ * the bag is open and has mapped it privately; changes reach the file
+ * through commitBag.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {char} filename - name of the bag file
+ * @param {bigbag_options_s} options - commit limits
+ * @param {bool} created - the bag is new, so every page is dirty
+**/
+static bool startDurable(struct bigbag_s *bag, const char *filename, const struct bigbag_options_s *options,
+                         bool created)
+{
+    struct durable_s *durable = calloc(1, sizeof(*durable));
+    durable->commit_ops = options->commit_ops;
+    durable->commit_ms = options->commit_ms;
+    char *name = journalName(filename);
+    durable->journal_fd = open(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    free(name);
+    if (durable->journal_fd == -1)
+    {
+        free(durable);
+        return false;
+    }
+    durable->page_size = sysconf(_SC_PAGESIZE);
+    uint64_t pages = bag->size / durable->page_size;
+    durable->dirty = calloc((pages + 7) / 8, 1);
+    if (created)
+        memset(durable->dirty, 0xff, (pages + 7) / 8);
+    bag->durable = durable;
+    return true;
+}
+
+/**
+ * Collect layout statistics of a bag.
+ * Method:
+ * 1. Walk the entries in file order and add up the free ones
+ * 2. Walk the list and count the elements and the links that jump
+ * 
+ * @param {bigbag_hdr_s} hdr - header of the file
+ * @param {bigbag_stats_s} stats - receives the statistics
+**/
+static void bagStats(struct bigbag_hdr_s *hdr, struct bigbag_stats_s *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    uint64_t size = bagSize(hdr);
+    uint64_t offset = firstEntryOffset(hdr);
+    while (offset + sizeof(struct bigbag_entry_s) <= size)
+    {
+        struct bigbag_entry_s *entry = entry_addr(hdr, offset);
+        if (entry->entry_magic == BIGBAG_FREE_ENTRY_MAGIC)
+        {
+            stats->free_bytes += sizeof(*entry) + entry->entry_len;
+            stats->free_entries++;
+            if (entry->entry_len > stats->largest_free)
+                stats->largest_free = entry->entry_len;
+        }
+        offset += sizeof(*entry) + entry->entry_len;
+    }
+    for (struct bigbag_entry_s *entry = entry_addr(hdr, hdr->first_element); entry;
+         entry = entry_addr(hdr, entry->next))
+    {
+        stats->elements++;
+        stats->used_bytes += sizeof(*entry) + entry->entry_len;
+        if (entry->next && entry->next != entry_end(hdr, entry))
+            stats->scattered_links++;
+    }
+}
+
+/**
+ * Create a temp file next to a bag, size it and map it, to write a new
+ * bag that is renamed over the old one when it is done.
+ * Returns MAP_FAILED, with nothing left behind, if that fails.
+ * 
+ * @param {char} filename - bag the temp file is for
+ * @param {uint64_t} size - size of the temp file
+ * @param {char} tmpname - receives the name of the temp file, to free
+ * @param {int} tmpfd - receives the temp file
+**/
+static void *mapTempBag(const char *filename, uint64_t size, char **tmpname, int *tmpfd)
+{
+    *tmpname = malloc(strlen(filename) + 8);
+    sprintf(*tmpname, "%s.XXXXXX", filename);
+    *tmpfd = mkstemp(*tmpname);
+    if (*tmpfd == -1)
+    {
+        free(*tmpname);
+        return MAP_FAILED;
+    }
+    void *file_base = MAP_FAILED;
+    if (ftruncate(*tmpfd, size) == 0)
+        file_base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, *tmpfd, 0);
+    if (file_base == MAP_FAILED)
+    {
+        unlink(*tmpname);
+        free(*tmpname);
+        close(*tmpfd);
+    }
+    return file_base;
+}
+
+/**
+ * Size a bag that holds strings back to back the way packBag lays them
+ * out: header, a keyed index with room for all of them, their entries and
+ * a free tail, doubling from BIGBAG_SIZE until it fits.
+ * Returns 0 if that is more than a bag can hold.
+ * 
+ * @param {char} strings - the strings
+ * @param {uint32_t} count - number of strings
+ * @param {uint64_t} index_slots - receives the number of slots of the index
+**/
+static uint64_t packedSize(const char **strings, uint32_t count, uint64_t *index_slots)
+{
+    // entryLen aligns entries like any indexed bag
+    struct bigbag_hdr_s header;
+    memset(&header, 0, sizeof(header));
+    header.magic = BIGBAG_MAGIC_V2;
+    *index_slots = INDEX_INITIAL_SLOTS;
+    while (*index_slots < count)
+        *index_slots *= 2;
+    if (*index_slots * sizeof(struct bigbag_slot_s) > BIGBAG_MAX_ENTRY_LEN)
+        *index_slots = BIGBAG_MAX_ENTRY_LEN / sizeof(struct bigbag_slot_s);
+    uint64_t needed = sizeof(header) + sizeof(struct bigbag_entry_s) + *index_slots * sizeof(struct bigbag_slot_s);
+    for (uint32_t i = 0; i < count; i++)
+        needed += sizeof(struct bigbag_entry_s) + entryLen(&header, strlen(strings[i]) + 1);
+    needed += MIN_ENTRY_SIZE;
+    uint64_t size = BIGBAG_SIZE;
+    while (size < needed)
+        size *= 2;
+    if (size > BIGBAG_MAX_SIZE || count > *index_slots)
+        return 0;
+    return size;
+}
+
+/**
+ * Fill a new mapping with a bag that holds sorted strings back to back.
+ * Method:
+ * 1. Write the header and an index entry right behind it
+ * 2. Copy each string into an entry right behind the last one, link it
+ *    to the one before and record its offset in the index
+ * 3. Give the rest of the mapping to the free list
+ * 
+ * @param {bigbag_s} bag - the mapping, of the size packedSize returned
+ * @param {char} strings - the strings, sorted
+ * @param {uint32_t} count - number of strings
+ * @param {uint64_t} index_slots - slots of the index, from packedSize
+**/
+static void packBag(struct bigbag_s *bag, const char **strings, uint32_t count, uint64_t index_slots)
+{
+    // header and index
+    struct bigbag_hdr_s *hdr = bag->hdr;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = BIGBAG_MAGIC_V2;
+    hdr->version = BIGBAG_VERSION;
+    hdr->size = bag->size;
+    hdr->index = sizeof(*hdr);
+    struct bigbag_entry_s *index = entry_addr(hdr, hdr->index);
+    index->next = 0;
+    index->entry_magic = BIGBAG_KEYED_INDEX_ENTRY_MAGIC;
+    index->entry_len = index_slots * sizeof(struct bigbag_slot_s);
+    struct bigbag_slot_s *slots = indexSlots(hdr);
+
+    // elements back to back in order
+    uint64_t offset = entry_end(hdr, index);
+    struct bigbag_entry_s *back = NULL;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        struct bigbag_entry_s *copy = entry_addr(hdr, offset);
+        copy->next = 0;
+        copy->entry_magic = BIGBAG_USED_ENTRY_MAGIC;
+        copy->entry_len = entryLen(hdr, strlen(strings[i]) + 1);
+        strcpy(copy->str, strings[i]);
+        if (back)
+            back->next = offset;
+        else
+            hdr->first_element = offset;
+        slots[hdr->element_count].offset = offset;
+        slots[hdr->element_count++].key = slotKey(copy->str);
+        back = copy;
+        offset += sizeof(*copy) + copy->entry_len;
+    }
+    freeRange(bag, offset, bag->size);
+}
+
+/**
+ * Rewrite a bag with its elements back to back in sorted order.
+ * Method:
+ * 1. Walk the list to collect the elements and size the new bag
+ *    (packedSize)
+ * 2. Create a temp file next to the bag and map it
+ * 3. Write the elements into it (packBag)
+ * 4. fsync the temp file, mark the old bag moved and rename the temp
+ *    file over it
+ * 
+ * Old bags come out in the current format, with an index and growable.
+ * Writers are locked out during the copy. Processes that have the bag
+ * open see the mark, or for old bags the new file behind the name, the
+ * next time they lock it and move to the new file (lockBag).
+ * 
+ * @param {char} filename - bag to compact
+ * @param {bigbag_s} bag - the bag, mapped writable and locked exclusively
+ * @param {bigbag_stats_s} before - statistics of the bag
+ * @param {bigbag_stats_s} after - receives the statistics of the new bag
+**/
+static int compactBag(const char *filename, struct bigbag_s *bag, struct bigbag_stats_s *before,
+                      struct bigbag_stats_s *after)
+{
+    struct bigbag_hdr_s *hdr = bag->hdr;
+
+    // the list is in sorted order
+    const char **strings = malloc(((uint64_t)before->elements + 1) * sizeof(char *));
+    uint32_t count = 0;
+    for (struct bigbag_entry_s *entry = entry_addr(hdr, hdr->first_element); entry && count < before->elements;
+         entry = entry_addr(hdr, entry->next))
+        strings[count++] = entry->str;
+    uint64_t index_slots;
+    uint64_t size = packedSize(strings, count, &index_slots);
+    if (size == 0)
+    {
+        free(strings);
+        return BIGBAG_ERR_FULL;
+    }
+
+    char *tmpname;
+    int tmpfd;
+    struct bigbag_hdr_s *compact = mapTempBag(filename, size, &tmpname, &tmpfd);
+    if (compact == MAP_FAILED)
+    {
+        free(strings);
+        return BIGBAG_ERR_IO;
+    }
+    struct bigbag_s target;
+    memset(&target, 0, sizeof(target));
+    target.fd = tmpfd;
+    target.hdr = compact;
+    target.size = size;
+    packBag(&target, strings, count, index_slots);
+    free(strings);
+
+    bagStats(compact, after);
+    struct stat stat;
+    fstat(bag->fd, &stat);
+    int status = BIGBAG_OK;
+    if (fsync(tmpfd) == -1 || fchmod(tmpfd, stat.st_mode & 0777) == -1)
+        status = BIGBAG_ERR_IO;
+    else
+    {
+        if (hasIndex(hdr))
+            __atomic_store_n(&hdr->moved, 1, __ATOMIC_RELEASE);
+        if (rename(tmpname, filename) == -1)
+        {
+            if (hasIndex(hdr))
+                __atomic_store_n(&hdr->moved, 0, __ATOMIC_RELEASE);
+            status = BIGBAG_ERR_IO;
+        }
+    }
+    if (status != BIGBAG_OK)
+        unlink(tmpname);
+    munmap(compact, size);
+    close(tmpfd);
+    free(tmpname);
+    return status;
+}
+
+/**
+ * A bag being built by bigbag_build: a temp file, mapped and filled front
+ * to back.
+**/
+struct build_s
+{
+    struct bigbag_s bag;
+    // where the next entry goes
+    uint64_t offset;
+    // the last entry so far, 0 before the first one
+    uint64_t last;
+    // a slot for every entry so far, the index is written behind them
+    struct bigbag_slot_s *slots;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+/**
+ * Make the bag being built at least need bytes, doubling its size.
+ * Returns false if it can't grow.
+ * 
+ * @param {build_s} build - the bag being built
+ * @param {uint64_t} need - size it needs
+**/
+static bool growBuild(struct build_s *build, uint64_t need)
+{
+    uint64_t size = build->bag.size;
+    while (size < need)
+        size *= 2;
+    if (size > BIGBAG_MAX_SIZE)
+        size = BIGBAG_MAX_SIZE;
+    if (size < need)
+        return false;
+    if (size == build->bag.size)
+        return true;
+    if (ftruncate(build->bag.fd, size) == -1)
+        return false;
+    void *file_base = mremap(build->bag.hdr, build->bag.size, size, MREMAP_MAYMOVE);
+    if (file_base == MAP_FAILED)
+        return false;
+    build->bag.hdr = file_base;
+    build->bag.size = size;
+    return true;
+}
+
+/**
+ * Write an element into a new entry right behind the last one and link
+ * it as the last element of the list.
+ * Returns BIGBAG_ERR_FULL if the bag would get too big, BIGBAG_ERR_IO
+ * if there is no memory for its index slot.
+ * 
+ * @param {build_s} build - the bag being built
+ * @param {char} element - element to add, not smaller than the last one
+**/
+static int buildEntry(struct build_s *build, const char *element)
+{
+    size_t len = strlen(element) + 1;
+    if (len > BIGBAG_MAX_ENTRY_LEN || build->count == BIGBAG_MAX_ENTRY_LEN / sizeof(struct bigbag_slot_s))
+        return BIGBAG_ERR_FULL;
+    uint64_t size = sizeof(struct bigbag_entry_s) + entryLen(build->bag.hdr, len);
+    if (!growBuild(build, build->offset + size))
+        return BIGBAG_ERR_FULL;
+    if (build->count == build->capacity)
+    {
+        struct bigbag_slot_s *slots = realloc(build->slots, build->capacity * 2 * sizeof(struct bigbag_slot_s));
+        if (!slots)
+            return BIGBAG_ERR_IO;
+        build->slots = slots;
+        build->capacity *= 2;
+    }
+    struct bigbag_hdr_s *hdr = build->bag.hdr;
+    struct bigbag_entry_s *entry = entry_addr(hdr, build->offset);
+    entry->next = 0;
+    entry->entry_magic = BIGBAG_USED_ENTRY_MAGIC;
+    entry->entry_len = size - sizeof(*entry);
+    memcpy(entry->str, element, len);
+    if (build->last)
+        entry_addr(hdr, build->last)->next = build->offset;
+    else
+        hdr->first_element = build->offset;
+    build->slots[build->count].offset = build->offset;
+    build->slots[build->count++].key = slotKey(entry->str);
+    build->last = build->offset;
+    build->offset += size;
+    return BIGBAG_OK;
+}
+
+/**
+ * Write the index behind the elements of a bag being built, give the
+ * rest of the file to the free list and fill in the header.
+ * The index gets room to grow like the one of a compacted bag.
+ * 
+ * @param {build_s} build - the bag being built
+**/
+static int finishBuild(struct build_s *build)
+{
+    uint64_t index_slots = INDEX_INITIAL_SLOTS;
+    while (index_slots < build->count)
+        index_slots *= 2;
+    if (index_slots * sizeof(struct bigbag_slot_s) > BIGBAG_MAX_ENTRY_LEN)
+        index_slots = BIGBAG_MAX_ENTRY_LEN / sizeof(struct bigbag_slot_s);
+    uint64_t index_len = index_slots * sizeof(struct bigbag_slot_s);
+    uint64_t index_end = build->offset + sizeof(struct bigbag_entry_s) + index_len;
+    if (!growBuild(build, index_end + MIN_ENTRY_SIZE))
+        return BIGBAG_ERR_FULL;
+
+    struct bigbag_hdr_s *hdr = build->bag.hdr;
+    hdr->magic = BIGBAG_MAGIC_V2;
+    hdr->version = BIGBAG_VERSION;
+    hdr->size = build->bag.size;
+    hdr->index = build->offset;
+    hdr->element_count = build->count;
+    struct bigbag_entry_s *index = entry_addr(hdr, hdr->index);
+    index->next = 0;
+    index->entry_magic = BIGBAG_KEYED_INDEX_ENTRY_MAGIC;
+    index->entry_len = index_len;
+    memcpy(index->str, build->slots, build->count * sizeof(struct bigbag_slot_s));
+    freeRange(&build->bag, index_end, hdr->size);
+    return BIGBAG_OK;
+}
+
+/**
+ * Build a bag from the lines of a file.
+ * Method:
+ * 1. Stream the lines into entries back to back, each linked to the one
+ *    before it, while they come in sorted order
+ * 2. At the first line that is smaller than the one before, start over:
+ *    keep the lines so far with the rest of the input in memory, sort
+ *    them and write the entries from the sorted lines
+ * 3. Write the index behind the entries and free the rest (finishBuild)
+ * 
+ * Sorted input is read once and only the index is kept in memory.
+ * 
+ * @param {build_s} build - the bag being built, mapped at BIGBAG_SIZE
+ * @param {char} input - file with one element per line
+**/
+static int buildBag(struct build_s *build, const char *input)
+{
+    FILE *fh = fopen(input, "r");
+    if (fh == NULL)
+        return BIGBAG_ERR_IO;
+    bool sorted = true;
+    int status = BIGBAG_OK;
+    char *line = NULL;
+    size_t bufsize = 0;
+    ssize_t len;
+    while (status == BIGBAG_OK && (len = getline(&line, &bufsize, fh)) != -1)
+    {
+        if (len && line[len - 1] == '\n')
+            line[len - 1] = 0;
+        if (!*line)
+            continue;
+        if (build->last && strcmp(entry_addr(build->bag.hdr, build->last)->str, line) > 0)
+        {
+            sorted = false;
+            break;
+        }
+        status = buildEntry(build, line);
+    }
+    if (!sorted)
+    {
+        // the input may be a pipe that can't be read again: start the
+        // lines from the entries so far and the line that broke the
+        // order, then read the rest of it
+        size_t size = strlen(line) + 1;
+        for (uint32_t i = 0; i < build->count; i++)
+            size += strlen(entry_addr(build->bag.hdr, build->slots[i].offset)->str) + 1;
+        char *data = malloc(size + 1);
+        if (!data)
+        {
+            free(line);
+            fclose(fh);
+            return BIGBAG_ERR_IO;
+        }
+        char *pos = data;
+        for (uint32_t i = 0; i < build->count; i++)
+            pos = stpcpy(pos, entry_addr(build->bag.hdr, build->slots[i].offset)->str) + 1;
+        strcpy(pos, line);
+        for (pos = data; pos < data + size; pos++)
+            if (*pos == 0)
+                *pos = '\n';
+        bool ok = readRest(fh, &data, &size);
+        free(line);
+        fclose(fh);
+        uint32_t count;
+        const char **lines = ok ? splitLines(data, size, &count) : NULL;
+        if (!lines)
+        {
+            free(data);
+            return BIGBAG_ERR_IO;
+        }
+        qsort(lines, count, sizeof(char *), compareStrings);
+        build->offset = sizeof(struct bigbag_hdr_s);
+        build->last = 0;
+        build->count = 0;
+        for (uint32_t i = 0; i < count && status == BIGBAG_OK; i++)
+            status = buildEntry(build, lines[i]);
+        free(lines);
+        free(data);
+    }
+    else
+    {
+        free(line);
+        if (ferror(fh))
+            status = BIGBAG_ERR_IO;
+        fclose(fh);
+    }
+    if (status == BIGBAG_OK)
+        status = finishBuild(build);
+    return status;
+}
+
+/**
+ * Unmap a bag and close its files.
+ * 
+ * @param {bigbag_s} bag - the bag, which is freed
+**/
+static void releaseBag(struct bigbag_s *bag)
+{
+    if (bag->hdr)
+        munmap(bag->hdr, bag->size);
+    if (bag->durable)
+    {
+        close(bag->durable->journal_fd);
+        free(bag->durable->dirty);
+        free(bag->durable);
+    }
+    // snapshots have no file
+    if (bag->fd != -1)
+        close(bag->fd);
+    free(bag->filename);
+    free(bag);
+}
+
+/**
+ * Fail bigbag_open: release what it set up so far.
+**/
+static struct bigbag_s *openFailed(struct bigbag_s *bag, int *status, int code)
+{
+    if (status)
+        *status = code;
+    releaseBag(bag);
+    return NULL;
+}
+
+/**
+ * Open a bag file, creating it if it doesn't exist.
+ * Method:
+ * 1. Open the file, take its flock (BIGBAG_DURABLE: the writer lock
+ *    first) and, if no other process holds the writer lock, finish a
+ *    group commit that a crash cut short (recoverJournal)
+ * 2. Make an empty file BIGBAG_SIZE bytes
+ * 3. Map it: shared, or private for BIGBAG_PRIVATE and BIGBAG_DURABLE
+ * 4. Set up the header and the index of a new bag, check an old one, and
+ *    only then let others at the file
+ * 5. BIGBAG_DURABLE: set up group commits, keeping the writer lock until
+ *    the bag is closed; readers only wait for its commits
+ * 
+ * Returns NULL, with the reason in *status, if the bag can't be opened.
+ * 
+ * @param {char} filename - name of the bag file
+ * @param {bigbag_options_s} options - how to open the bag, NULL for a shared bag
+ * @param {int} status - receives BIGBAG_OK or the reason of a failure, may be NULL
+**/
+struct bigbag_s *bigbag_open(const char *filename, const struct bigbag_options_s *options, int *status)
+{
+    struct bigbag_options_s shared = {0, 0, 0};
+    if (!options)
+        options = &shared;
+    bool durable = options->flags & BIGBAG_DURABLE;
+    struct bigbag_s *bag = calloc(1, sizeof(*bag));
+    bag->private = options->flags & (BIGBAG_PRIVATE | BIGBAG_DURABLE);
+    bag->fd = open(filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (bag->fd == -1)
+    {
+        free(bag);
+        if (status)
+            *status = BIGBAG_ERR_IO;
+        return NULL;
+    }
+
+    bag->filename = strdup(filename);
+
+    // Finish a commit that a crash cut short before using the bag, and
+    // make a new file into a bag, before anyone else looks at it.
+    // A durable bag keeps the writer lock until it is closed.
+    if (durable)
+        writerLock(bag->fd, F_WRLCK);
+    flock(bag->fd, LOCK_EX);
+    // bigbag_compact may have renamed a new file over the one opened
+    while (!namesFile(filename, bag->fd))
+    {
+        close(bag->fd);
+        bag->fd = open(filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+        if (bag->fd == -1)
+            return openFailed(bag, status, BIGBAG_ERR_IO);
+        if (durable)
+            writerLock(bag->fd, F_WRLCK);
+        flock(bag->fd, LOCK_EX);
+    }
+    // Only replay the journal with the writer lock: a durable bag that
+    // holds it owns the journal and may be between syncing it and
+    // writing it to the bag. Its next commit or open replays it then.
+    bool recover = durable || tryWriterLock(bag->fd);
+    if (recover && !recoverJournal(filename, bag->fd))
+        return openFailed(bag, status, BIGBAG_ERR_IO);
+    if (recover && !durable)
+        writerLock(bag->fd, F_UNLCK);
+
+    struct stat stat;
+    fstat(bag->fd, &stat);
+    bool created = stat.st_size == 0;
+    if (created)
+    {
+        // Make file 64K
+        if (ftruncate(bag->fd, BIGBAG_SIZE) == -1)
+            return openFailed(bag, status, BIGBAG_ERR_IO);
+        stat.st_size = BIGBAG_SIZE;
+    }
+
+    // Determine mmap method (private/shared) based on the flags
+    void *file_base = mmap(0, stat.st_size, PROT_READ | PROT_WRITE, bag->private ? MAP_PRIVATE : MAP_SHARED,
+                           bag->fd, 0);
+    if (file_base == MAP_FAILED)
+        return openFailed(bag, status, BIGBAG_ERR_IO);
+    bag->hdr = file_base;
+    bag->size = stat.st_size;
+
+    struct bigbag_hdr_s *hdr = bag->hdr;
+    // If file was empty, make it the desired format
+    if (created)
+    {
+        // create header
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->first_element = 0;
+        hdr->magic = BIGBAG_MAGIC_V2;
+        hdr->version = BIGBAG_VERSION;
+        hdr->size = BIGBAG_SIZE;
+        hdr->element_count = 0;
+        // Set up the (empty) index right after the header
+        hdr->index = sizeof(*hdr);
+        struct bigbag_entry_s *index = entry_addr(hdr, hdr->index);
+        index->next = 0;
+        index->entry_magic = BIGBAG_KEYED_INDEX_ENTRY_MAGIC;
+        index->entry_len = INDEX_INITIAL_SLOTS * sizeof(struct bigbag_slot_s);
+        // Set up first entry of free space
+        hdr->first_free = hdr->index + sizeof(*index) + index->entry_len;
+        struct bigbag_entry_s *entry = entry_addr(hdr, hdr->first_free);
+        entry->next = 0;
+        entry->entry_magic = BIGBAG_FREE_ENTRY_MAGIC;
+        entry->entry_len = BIGBAG_SIZE - hdr->first_free - sizeof(*entry);
+    }
+    else if (!validBag(hdr, bag->size))
+    {
+        return openFailed(bag, status, BIGBAG_ERR_FORMAT);
+    }
+    if (durable && !startDurable(bag, filename, options, created))
+        return openFailed(bag, status, BIGBAG_ERR_IO);
+    // a new durable bag is committed right away, a crash won't leave it
+    // blank; commitBag releases the flock once it is written
+    if (created && bag->durable && !commitBag(bag))
+        return openFailed(bag, status, BIGBAG_ERR_IO);
+    flock(bag->fd, LOCK_UN);
+    // only take the writer lock when there is something to upgrade: a
+    // durable bag may hold it for a long time
+    if (hasIndex(hdr) && (hdr->version < BIGBAG_VERSION ||
+                          entry_addr(hdr, hdr->index)->entry_magic != BIGBAG_KEYED_INDEX_ENTRY_MAGIC))
+    {
+        // older code doesn't know about hdr->seq or keyed indexes, keep
+        // it away from the bag
+        if (!beginWrite(bag))
+            return openFailed(bag, status, BIGBAG_ERR_IO);
+        bool upgraded = upgradeIndex(bag);
+        if (upgraded && (!bag->private || bag->durable) && bag->hdr->version < BIGBAG_VERSION)
+        {
+            bag->hdr->version = BIGBAG_VERSION;
+            markDirty(bag, bag->hdr, sizeof(*bag->hdr));
+        }
+        endWrite(bag);
+        if (!upgraded)
+            return openFailed(bag, status, BIGBAG_ERR_FULL);
+    }
+    if (status)
+        *status = BIGBAG_OK;
+    return bag;
+}
+
+/**
+ * Close a bag. A durable bag commits what is left first.
+ * Returns BIGBAG_ERR_COMMIT if that commit fails; the bag is closed anyway
+ * and the next open finishes the commit from the journal, if it got there.
+ * 
+ * @param {bigbag_s} bag - the open bag, which is freed
+**/
+int bigbag_close(struct bigbag_s *bag)
+{
+    int status = bigbag_commit(bag);
+    releaseBag(bag);
+    return status;
+}
+
+/**
+ * Finish a change: release the writer lock and, for a durable bag,
+ * commit once the limits are reached.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {int} status - outcome of the change
+**/
+static int endChange(struct bigbag_s *bag, int status)
+{
+    endWrite(bag);
+    if (bag->durable && !maybeCommit(bag))
+        return BIGBAG_ERR_COMMIT;
+    return status;
+}
+
+/**
+ * Return false, with errno set to EROFS, for a snapshot: it can't change.
+ * 
+ * @param {bigbag_s} bag - the open bag
+**/
+static bool writable(struct bigbag_s *bag)
+{
+    if (bag->snapshot)
+        errno = EROFS;
+    return !bag->snapshot;
+}
+
+/**
+ * Add an element to the bag, keeping the bag sorted.
+ * Returns BIGBAG_ERR_FULL if there is no room for it.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {char} element - element to add
+**/
+int bigbag_add(struct bigbag_s *bag, const char *element)
+{
+    if (!writable(bag))
+        return BIGBAG_ERR_IO;
+    if (!beginWrite(bag))
+        return BIGBAG_ERR_IO;
+    return endChange(bag, addElement(bag, element));
+}
+
+/**
+ * Add many elements at once, in any order.
+ * Either every element is added or, with BIGBAG_ERR_FULL, none is.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {char} elements - elements to add
+ * @param {uint32_t} count - number of elements
+**/
+int bigbag_add_batch(struct bigbag_s *bag, const char **elements, uint32_t count)
+{
+    if (!writable(bag))
+        return BIGBAG_ERR_IO;
+    const char **sorted = malloc((count + 1) * sizeof(char *));
+    if (!sorted)
+        return BIGBAG_ERR_IO;
+    memcpy(sorted, elements, count * sizeof(char *));
+    qsort(sorted, count, sizeof(char *), compareStrings);
+    int status = BIGBAG_ERR_IO;
+    if (beginWrite(bag))
+        status = endChange(bag, addBatch(bag, sorted, count));
+    free(sorted);
+    return status;
+}
+
+/**
+ * Add every line of a file as an element, like bigbag_add_batch.
+ * Empty lines are skipped.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {char} filename - file with one element per line
+ * @param {uint32_t} count - receives the number of elements added, may be NULL
+**/
+int bigbag_add_file(struct bigbag_s *bag, const char *filename, uint32_t *count)
+{
+    if (count)
+        *count = 0;
+    if (!writable(bag))
+        return BIGBAG_ERR_IO;
+    char *data;
+    uint32_t lines_count;
+    const char **lines = bigbag_read_lines(filename, &data, &lines_count);
+    if (!lines)
+        return BIGBAG_ERR_IO;
+    qsort(lines, lines_count, sizeof(char *), compareStrings);
+    int status = BIGBAG_ERR_IO;
+    if (beginWrite(bag))
+        status = endChange(bag, addBatch(bag, lines, lines_count));
+    if (count)
+        *count = status == BIGBAG_OK ? lines_count : 0;
+    free(lines);
+    free(data);
+    return status;
+}
+
+/**
+ * Remove one copy of an element from the bag.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {char} element - element to remove
+**/
+int bigbag_delete(struct bigbag_s *bag, const char *element)
+{
+    if (!writable(bag))
+        return BIGBAG_ERR_IO;
+    if (!beginWrite(bag))
+        return BIGBAG_ERR_IO;
+    return endChange(bag, deleteElement(bag, element));
+}
+
+/**
+ * Check if an element is in the bag.
+ * Returns BIGBAG_OK if it is, BIGBAG_ERR_NOT_FOUND if it isn't.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {char} element - element to look for
+**/
+int bigbag_check(struct bigbag_s *bag, const char *element)
+{
+    struct find_s find = {element, false};
+    if (!readBag(bag, findReader, &find))
+        return BIGBAG_ERR_CORRUPT;
+    return find.found ? BIGBAG_OK : BIGBAG_ERR_NOT_FOUND;
+}
+
+/**
+ * Collect the elements of a range and call visit for each of them.
+ * The elements are copied out of the bag first, so visit may change it.
+**/
+static int visitRange(struct bigbag_s *bag, struct range_s *range, bigbag_visit_f visit, void *arg)
+{
+    int status = BIGBAG_OK;
+    if (!readBag(bag, rangeReader, range))
+        status = BIGBAG_ERR_CORRUPT;
+    else if (range->out.failed)
+        status = BIGBAG_ERR_IO;
+    else
+        visitStrings(&range->out, visit, arg);
+    free(range->out.data);
+    return status;
+}
+
+/**
+ * Call visit for every element of the bag in sorted order.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {bigbag_visit_f} visit - called for each element
+ * @param {void} arg - passed to visit
+**/
+int bigbag_foreach(struct bigbag_s *bag, bigbag_visit_f visit, void *arg)
+{
+    struct range_s range = {NULL, NULL, false, {NULL, 0, 0, false}};
+    return visitRange(bag, &range, visit, arg);
+}
+
+/**
+ * Call visit, in sorted order, for every element lo <= element <= hi.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {char} lo - first element of the range, NULL for no lower bound
+ * @param {char} hi - last element of the range, NULL for no upper bound
+ * @param {bigbag_visit_f} visit - called for each element
+ * @param {void} arg - passed to visit
+**/
+int bigbag_range(struct bigbag_s *bag, const char *lo, const char *hi, bigbag_visit_f visit, void *arg)
+{
+    struct range_s range = {lo, hi, false, {NULL, 0, 0, false}};
+    return visitRange(bag, &range, visit, arg);
+}
+
+/**
+ * Call visit, in sorted order, for every element that starts with prefix.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {char} prefix - start of the elements
+ * @param {bigbag_visit_f} visit - called for each element
+ * @param {void} arg - passed to visit
+**/
+int bigbag_prefix(struct bigbag_s *bag, const char *prefix, bigbag_visit_f visit, void *arg)
+{
+    struct range_s range = {prefix, NULL, true, {NULL, 0, 0, false}};
+    return visitRange(bag, &range, visit, arg);
+}
+
+/**
+ * Commit the changes of a durable bag now instead of waiting for the
+ * limits. Other bags write their changes as they are made.
+ * 
+ * @param {bigbag_s} bag - the open bag
+**/
+int bigbag_commit(struct bigbag_s *bag)
+{
+    if (bag->durable && !commitBag(bag))
+        return BIGBAG_ERR_COMMIT;
+    return BIGBAG_OK;
+}
+
+/**
+ * Collect layout statistics of an open bag.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {bigbag_stats_s} stats - receives the statistics
+**/
+int bigbag_stats(struct bigbag_s *bag, struct bigbag_stats_s *stats)
+{
+    if (bag->private)
+    {
+        bagStats(bag->hdr, stats);
+        return BIGBAG_OK;
+    }
+    // the walk isn't bounds checked like the readers, keep writers out
+    if (!lockBag(bag, LOCK_SH))
+        return BIGBAG_ERR_IO;
+    bagStats(bag->hdr, stats);
+    flock(bag->fd, LOCK_UN);
+    return BIGBAG_OK;
+}
+
+/**
+ * Take a snapshot of a bag: a read-only copy of it at one point in time,
+ * to scan for as long as needed while writers go on changing the bag.
+ * Method:
+ * 1. Collect the elements the way bigbag_foreach does, without the lock
+ *    (readUnlocked)
+ * 2. If writers keep changing the bag, take the lock shared just long
+ *    enough to copy the mapping and collect the elements from the copy
+ * 3. Write them back to back into an anonymous mapping (packBag)
+ * 4. Make the copy read-only and wrap it in a bag of its own
+ * 
+ * This is a full copy of the live elements, not copy-on-write: it costs
+ * time and memory in proportion to them. A mapping of the file can't be
+ * frozen (MAP_PRIVATE pages still follow the file until written) and
+ * writers change entries in place. Writers wait for one memcpy of the
+ * file at most.
+ * 
+ * Snapshots take bigbag_check, bigbag_foreach, bigbag_range,
+ * bigbag_prefix, bigbag_stats and bigbag_save; changes fail with
+ * BIGBAG_ERR_IO and errno EROFS. Close them with bigbag_close.
+ * A snapshot is laid out like a compacted bag, in the current format.
+ * A durable bag's snapshot includes the changes it hasn't committed yet.
+ * 
+ * @param {bigbag_s} bag - the open bag
+ * @param {int} status - receives BIGBAG_OK or the reason of a failure, may be NULL
+**/
+struct bigbag_s *bigbag_snapshot(struct bigbag_s *bag, int *status)
+{
+    struct range_s range = {NULL, NULL, false, {NULL, 0, 0, false}};
+    struct bigbag_s *copy = NULL;
+    int result = BIGBAG_OK;
+    bool ok;
+    if (bag->private)
+        ok = rangeReader(bag->hdr, bag->size, &range);
+    else if (!(ok = readUnlocked(bag, rangeReader, &range)) && (ok = lockBag(bag, LOCK_SH)))
+    {
+        uint64_t size = bag->size;
+        void *file = malloc(size);
+        if (file)
+            memcpy(file, bag->hdr, size);
+        flock(bag->fd, LOCK_UN);
+        if (!file)
+            range.out.failed = true;
+        ok = !file || rangeReader(file, size, &range);
+        free(file);
+    }
+    if (!ok)
+        result = BIGBAG_ERR_CORRUPT;
+    else if (range.out.failed)
+        result = BIGBAG_ERR_IO;
+    else
+    {
+        uint32_t count = 0;
+        for (size_t pos = 0; pos < range.out.len; pos += strlen(range.out.data + pos) + 1)
+            count++;
+        const char **strings = malloc((count + 1) * sizeof(char *));
+        count = 0;
+        for (size_t pos = 0; strings && pos < range.out.len; pos += strlen(range.out.data + pos) + 1)
+            strings[count++] = range.out.data + pos;
+        uint64_t index_slots;
+        uint64_t size = strings ? packedSize(strings, count, &index_slots) : 0;
+        void *file_base = MAP_FAILED;
+        if (!strings)
+            result = BIGBAG_ERR_IO;
+        else if (size == 0)
+            result = BIGBAG_ERR_FULL;
+        else if ((file_base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) ==
+                 MAP_FAILED)
+            result = BIGBAG_ERR_IO;
+        else if (!(copy = calloc(1, sizeof(*copy))))
+        {
+            munmap(file_base, size);
+            result = BIGBAG_ERR_IO;
+        }
+        else
+        {
+            copy->fd = -1;
+            copy->private = true;
+            copy->snapshot = true;
+            copy->hdr = file_base;
+            copy->size = size;
+            packBag(copy, strings, count, index_slots);
+            mprotect(file_base, size, PROT_READ);
+        }
+        free(strings);
+    }
+    free(range.out.data);
+    if (status)
+        *status = result;
+    return copy;
+}
+
+/**
+ * Write a bag to a new bag file, as a backup: a snapshot as it is, any
+ * other bag through a snapshot taken for the purpose. The file is
+ * written under a temp name and renamed when it is complete.
+ * 
+ * @param {bigbag_s} bag - the open bag or snapshot
+ * @param {char} filename - file to write
+**/
+int bigbag_save(struct bigbag_s *bag, const char *filename)
+{
+    int status = BIGBAG_OK;
+    struct bigbag_s *snapshot = bag->snapshot ? bag : bigbag_snapshot(bag, &status);
+    if (!snapshot)
+        return status;
+    char *tmpname;
+    int tmpfd;
+    void *file_base = mapTempBag(filename, snapshot->size, &tmpname, &tmpfd);
+    if (file_base == MAP_FAILED)
+        status = BIGBAG_ERR_IO;
+    else
+    {
+        memcpy(file_base, snapshot->hdr, snapshot->size);
+        if (fsync(tmpfd) == -1 || rename(tmpname, filename) == -1)
+        {
+            unlink(tmpname);
+            status = BIGBAG_ERR_IO;
+        }
+        munmap(file_base, snapshot->size);
+        close(tmpfd);
+        free(tmpname);
+    }
+    if (snapshot != bag)
+        bigbag_close(snapshot);
+    return status;
+}
+
+/**
+ * Rewrite a bag file with its elements back to back in sorted order,
+ * see compactBag. Processes that have the bag open go on with the new
+ * file; a durable bag keeps the writer lock, so compacting it waits until
+ * it is closed.
+ * 
+ * @param {char} filename - bag to compact
+ * @param {bigbag_stats_s} before - receives the statistics before compacting
+ * @param {bigbag_stats_s} after - receives the statistics after compacting
+**/
+int bigbag_compact(const char *filename, struct bigbag_stats_s *before, struct bigbag_stats_s *after)
+{
+    struct bigbag_s bag;
+    memset(&bag, 0, sizeof(bag));
+    bag.fd = open(filename, O_RDWR);
+    if (bag.fd == -1)
+        return BIGBAG_ERR_IO;
+    // keep writers out while copying, and until they can see the bag moved
+    writerLock(bag.fd, F_WRLCK);
+    flock(bag.fd, LOCK_EX);
+    // another compaction may have replaced the file in the meantime
+    while (!namesFile(filename, bag.fd))
+    {
+        close(bag.fd);
+        bag.fd = open(filename, O_RDWR);
+        if (bag.fd == -1)
+            return BIGBAG_ERR_IO;
+        writerLock(bag.fd, F_WRLCK);
+        flock(bag.fd, LOCK_EX);
+    }
+    int status = BIGBAG_OK;
+    struct stat stat;
+    if (!recoverJournal(filename, bag.fd) || fstat(bag.fd, &stat) == -1)
+        status = BIGBAG_ERR_IO;
+    else if (stat.st_size == 0)
+        status = BIGBAG_ERR_FORMAT;
+    if (status == BIGBAG_OK)
+    {
+        bag.size = stat.st_size;
+        bag.hdr = mmap(0, bag.size, PROT_READ | PROT_WRITE, MAP_SHARED, bag.fd, 0);
+        if (bag.hdr == MAP_FAILED)
+            status = BIGBAG_ERR_IO;
+        else if (!validBag(bag.hdr, bag.size))
+            status = BIGBAG_ERR_FORMAT;
+        if (status == BIGBAG_OK)
+        {
+            bagStats(bag.hdr, before);
+            status = compactBag(filename, &bag, before, after);
+        }
+        if (bag.hdr != MAP_FAILED)
+            munmap(bag.hdr, bag.size);
+    }
+    close(bag.fd);
+    return status;
+}
+
+/**
+ * Build a new bag from a file with one element per line, see buildBag.
+ * The bag is written to a temp file and renamed over filename, so a bag
+ * that was there before is replaced; don't build over a bag in use.
+ * 
+ * @param {char} filename - bag to build
+ * @param {char} input - file with one element per line, best sorted
+ * @param {uint32_t} count - receives the number of elements, may be NULL
+**/
+int bigbag_build(const char *filename, const char *input, uint32_t *count)
+{
+    struct build_s build;
+    memset(&build, 0, sizeof(build));
+    char *tmpname;
+    build.bag.hdr = mapTempBag(filename, BIGBAG_SIZE, &tmpname, &build.bag.fd);
+    if (build.bag.hdr == MAP_FAILED)
+        return BIGBAG_ERR_IO;
+    build.bag.size = BIGBAG_SIZE;
+    // entryLen aligns entries like any indexed bag
+    build.bag.hdr->magic = BIGBAG_MAGIC_V2;
+    build.offset = sizeof(struct bigbag_hdr_s);
+    build.capacity = INDEX_INITIAL_SLOTS;
+    build.slots = malloc(build.capacity * sizeof(struct bigbag_slot_s));
+
+    int status = build.slots ? buildBag(&build, input) : BIGBAG_ERR_IO;
+    if (status == BIGBAG_OK && (fsync(build.bag.fd) == -1 || rename(tmpname, filename) == -1))
+        status = BIGBAG_ERR_IO;
+    if (status != BIGBAG_OK)
+        unlink(tmpname);
+    if (count)
+        *count = status == BIGBAG_OK ? build.count : 0;
+    munmap(build.bag.hdr, build.bag.size);
+    close(build.bag.fd);
+    free(build.slots);
+    free(tmpname);
+    return status;
+}
+
+/**
+ * Return a message for a status code.
+**/
+const char *bigbag_strerror(int status)
+{
+    switch (status)
+    {
+    case BIGBAG_OK:
+        return "ok";
+    case BIGBAG_ERR_NOT_FOUND:
+        return "not found";
+    case BIGBAG_ERR_FULL:
+        return "out of space";
+    case BIGBAG_ERR_FORMAT:
+        return "not a bag";
+    case BIGBAG_ERR_IO:
+        return strerror(errno);
+    case BIGBAG_ERR_CORRUPT:
+        return "bag is corrupt";
+    case BIGBAG_ERR_COMMIT:
+        return strerror(errno);
+    }
+    return "unknown error";
+}
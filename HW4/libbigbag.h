@@ -0,0 +1,91 @@
+#include <stdbool.h>
+#include <stdint.h>
+#pragma once
+
+/**
+ * libbigbag: bag files for use in-process.
+ * Build with: gcc -O2 -c libbigbag.c, then link libbigbag.o into the program.
+ * bigbag.h describes the file format.
+ *
+ * Every call returns one of the status codes below. Nothing is printed.
+**/
+
+#define BIGBAG_OK 0
+// the element is not in the bag
+#define BIGBAG_ERR_NOT_FOUND -1
+// no room for the element and the bag can't grow
+#define BIGBAG_ERR_FULL -2
+// the file is not a bag, or a bag version this code can't open
+#define BIGBAG_ERR_FORMAT -3
+// a system call failed, errno says why
+#define BIGBAG_ERR_IO -4
+// the list or the index of the bag doesn't hold together
+#define BIGBAG_ERR_CORRUPT -5
+// a group commit of a durable bag failed, errno says why; the change was
+// made but may not reach the file (-6 is BIGBAG_ERR_REQUEST of bigbag -b)
+#define BIGBAG_ERR_COMMIT -7
+
+// changes stay in this process and are never written to the file (-t)
+#define BIGBAG_PRIVATE 1
+// changes are written to the file in group commits (-D)
+#define BIGBAG_DURABLE 2
+
+struct bigbag_options_s
+{
+    // BIGBAG_PRIVATE or BIGBAG_DURABLE, 0 for a shared bag
+    int flags;
+    // BIGBAG_DURABLE: commit after this many changes or this many ms,
+    // 0 for no limit
+    uint32_t commit_ops;
+    uint32_t commit_ms;
+};
+
+// An open bag
+struct bigbag_s;
+
+/**
+ * Layout statistics of a bag.
+**/
+struct bigbag_stats_s
+{
+    uint32_t elements;
+    // entries holding elements, entry headers included
+    uint64_t used_bytes;
+    // free entries in file order, entry headers included
+    uint64_t free_bytes;
+    uint32_t free_entries;
+    uint32_t largest_free;
+    // list links that don't point at the entry right behind them in the file
+    uint32_t scattered_links;
+};
+
+/**
+ * Called for each element by bigbag_foreach, bigbag_range and
+ * bigbag_prefix, in sorted order. Return false to stop.
+**/
+typedef bool (*bigbag_visit_f)(const char *element, void *arg);
+
+struct bigbag_s *bigbag_open(const char *filename, const struct bigbag_options_s *options, int *status);
+int bigbag_close(struct bigbag_s *bag);
+
+int bigbag_add(struct bigbag_s *bag, const char *element);
+int bigbag_add_batch(struct bigbag_s *bag, const char **elements, uint32_t count);
+int bigbag_add_file(struct bigbag_s *bag, const char *filename, uint32_t *count);
+int bigbag_delete(struct bigbag_s *bag, const char *element);
+int bigbag_check(struct bigbag_s *bag, const char *element);
+int bigbag_foreach(struct bigbag_s *bag, bigbag_visit_f visit, void *arg);
+// lo <= element <= hi, NULL for an open end
+int bigbag_range(struct bigbag_s *bag, const char *lo, const char *hi, bigbag_visit_f visit, void *arg);
+int bigbag_prefix(struct bigbag_s *bag, const char *prefix, bigbag_visit_f visit, void *arg);
+
+int bigbag_commit(struct bigbag_s *bag);
+// a read-only copy of the bag at one point in time, closed with bigbag_close
+struct bigbag_s *bigbag_snapshot(struct bigbag_s *bag, int *status);
+// write the bag, or a snapshot, to a new bag file
+int bigbag_save(struct bigbag_s *bag, const char *filename);
+int bigbag_stats(struct bigbag_s *bag, struct bigbag_stats_s *stats);
+int bigbag_compact(const char *filename, struct bigbag_stats_s *before, struct bigbag_stats_s *after);
+// a new bag from a file with one element per line, fastest when it is sorted
+int bigbag_build(const char *filename, const char *input, uint32_t *count);
+
+const char *bigbag_strerror(int status);
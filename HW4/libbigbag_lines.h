@@ -0,0 +1,15 @@
+#include <stdint.h>
+#pragma once
+
+/**
+ * Internal to libbigbag.c and libbigbag_shards.c: not part of the API.
+**/
+
+/**
+ * Read a whole file, pipes included, and split it into lines; empty
+ * lines are skipped. The lines point into *data, which the caller frees
+ * along with them.
+ * Returns NULL, with errno set, if the file can't be read or there is
+ * no memory for it.
+**/
+const char **bigbag_read_lines(const char *filename, char **data, uint32_t *count);
@@ -0,0 +1,423 @@
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "libbigbag_shards.h"
+#include "libbigbag_lines.h"
+
+/**
+ * One shard of a store: a bag and the lock every call on it takes.
+ * A bigbag_s can't be used by two threads at once.
+**/
+struct shard_s
+{
+    struct bigbag_s *bag;
+    pthread_mutex_t lock;
+};
+
+/**
+ * An open sharded store.
+**/
+struct bigbag_shards_s
+{
+    uint32_t count;
+    struct shard_s *shards;
+};
+
+/**
+ * Elements of one shard, copied out for mergeShards.
+**/
+struct shard_list_s
+{
+    char *data;
+    size_t len;
+    size_t cap;
+    // start of the next element to merge
+    size_t pos;
+    // out of memory while collecting
+    bool failed;
+};
+
+/**
+ * Which elements mergeShards collects: all, lo..hi, or a prefix in lo.
+**/
+#define QUERY_ALL 0
+#define QUERY_RANGE 1
+#define QUERY_PREFIX 2
+
+/**
+ * Return the name of a shard file.
+**/
+static char *shardName(const char *dirname, uint32_t shard)
+{
+    char *name = malloc(strlen(dirname) + sizeof("/shard-0000.bag") + 8);
+    sprintf(name, "%s/shard-%04u.bag", dirname, shard);
+    return name;
+}
+
+/**
+ * Return the number of shard files in a directory.
+**/
+static uint32_t countShards(const char *dirname)
+{
+    uint32_t count = 0;
+    for (;; count++)
+    {
+        char *name = shardName(dirname, count);
+        struct stat st;
+        bool exists = stat(name, &st) == 0;
+        free(name);
+        if (!exists)
+            return count;
+    }
+}
+
+/**
+ * Open a sharded store, creating the directory and the shards if needed.
+ * Method:
+ * 1. Count the shards already in the directory
+ * 2. A new store gets shards bags; an old one must have shards of them,
+ *    or any number if shards is 0
+ * 3. Open every shard with options
+ *
+ * Returns NULL, with the reason in *status, on failure.
+ *
+ * @param {char} dirname - directory of the store
+ * @param {uint32_t} shards - number of shards, 0 to use the existing ones
+ * @param {bigbag_options_s} options - how to open the shards, NULL for shared
+ * @param {int} status - receives BIGBAG_OK or the reason of a failure, may be NULL
+**/
+struct bigbag_shards_s *bigbag_shards_open(const char *dirname, uint32_t shards,
+                                           const struct bigbag_options_s *options, int *status)
+{
+    int result = BIGBAG_OK;
+    if (mkdir(dirname, S_IRWXU) == -1 && errno != EEXIST)
+        result = BIGBAG_ERR_IO;
+    uint32_t existing = result == BIGBAG_OK ? countShards(dirname) : 0;
+    if (result == BIGBAG_OK && (existing ? shards && shards != existing : shards == 0))
+        result = BIGBAG_ERR_FORMAT;
+    if (result != BIGBAG_OK)
+    {
+        if (status)
+            *status = result;
+        return NULL;
+    }
+
+    struct bigbag_shards_s *store = malloc(sizeof(*store));
+    store->count = existing ? existing : shards;
+    store->shards = calloc(store->count, sizeof(struct shard_s));
+    for (uint32_t i = 0; i < store->count; i++)
+    {
+        char *name = shardName(dirname, i);
+        store->shards[i].bag = bigbag_open(name, options, &result);
+        free(name);
+        if (!store->shards[i].bag)
+        {
+            store->count = i;
+            bigbag_shards_close(store);
+            if (status)
+                *status = result;
+            return NULL;
+        }
+        pthread_mutex_init(&store->shards[i].lock, NULL);
+    }
+    if (status)
+        *status = BIGBAG_OK;
+    return store;
+}
+
+/**
+ * Close every shard of a store.
+ *
+ * @param {bigbag_shards_s} store - the open store, which is freed
+**/
+int bigbag_shards_close(struct bigbag_shards_s *store)
+{
+    int status = BIGBAG_OK;
+    for (uint32_t i = 0; i < store->count; i++)
+    {
+        int closed = bigbag_close(store->shards[i].bag);
+        if (closed != BIGBAG_OK)
+            status = closed;
+        pthread_mutex_destroy(&store->shards[i].lock);
+    }
+    free(store->shards);
+    free(store);
+    return status;
+}
+
+/**
+ * Return the number of shards of a store.
+**/
+uint32_t bigbag_shards_count(struct bigbag_shards_s *store)
+{
+    return store->count;
+}
+
+/**
+ * Return the shard an element belongs to: FNV-1a of the element
+ * modulo the number of shards.
+ *
+ * @param {bigbag_shards_s} store - the open store
+ * @param {char} element - the element
+**/
+uint32_t bigbag_shard_of(struct bigbag_shards_s *store, const char *element)
+{
+    uint32_t hash = 0x811c9dc5;
+    for (const unsigned char *c = (const unsigned char *)element; *c; c++)
+        hash = (hash ^ *c) * 0x01000193;
+    return hash % store->count;
+}
+
+/**
+ * Add an element to its shard.
+**/
+int bigbag_shards_add(struct bigbag_shards_s *store, const char *element)
+{
+    struct shard_s *shard = &store->shards[bigbag_shard_of(store, element)];
+    pthread_mutex_lock(&shard->lock);
+    int status = bigbag_add(shard->bag, element);
+    pthread_mutex_unlock(&shard->lock);
+    return status;
+}
+
+/**
+ * Remove an element from its shard.
+**/
+int bigbag_shards_delete(struct bigbag_shards_s *store, const char *element)
+{
+    struct shard_s *shard = &store->shards[bigbag_shard_of(store, element)];
+    pthread_mutex_lock(&shard->lock);
+    int status = bigbag_delete(shard->bag, element);
+    pthread_mutex_unlock(&shard->lock);
+    return status;
+}
+
+/**
+ * Check if an element is in its shard.
+**/
+int bigbag_shards_check(struct bigbag_shards_s *store, const char *element)
+{
+    struct shard_s *shard = &store->shards[bigbag_shard_of(store, element)];
+    pthread_mutex_lock(&shard->lock);
+    int status = bigbag_check(shard->bag, element);
+    pthread_mutex_unlock(&shard->lock);
+    return status;
+}
+
+/**
+ * Add every line of a file as an element.
+ * Method:
+ * 1. Read the file and split it into lines (bigbag_read_lines)
+ * 2. Group the lines by shard
+ * 3. Add each group with bigbag_add_batch, one shard locked at a time
+ *
+ * Each shard gets all of its elements or none; when one is out of space
+ * the others still get theirs, and *count says how many were added.
+ *
+ * @param {bigbag_shards_s} store - the open store
+ * @param {char} filename - file with one element per line
+ * @param {uint32_t} count - receives the number of elements added, may be NULL
+**/
+int bigbag_shards_add_file(struct bigbag_shards_s *store, const char *filename, uint32_t *count)
+{
+    char *data;
+    uint32_t total;
+    const char **unsorted = bigbag_read_lines(filename, &data, &total);
+    if (!unsorted)
+        return BIGBAG_ERR_IO;
+
+    // every line goes to lines[], grouped by shard through starts[]
+    uint32_t *shard_of = malloc((total + 1) * sizeof(uint32_t));
+    uint32_t *starts = calloc(store->count + 1, sizeof(uint32_t));
+    const char **lines = malloc((total + 1) * sizeof(char *));
+    uint32_t *next = malloc((store->count + 1) * sizeof(uint32_t));
+    int status = shard_of && starts && lines && next ? BIGBAG_OK : BIGBAG_ERR_IO;
+    uint32_t added = 0;
+    if (status == BIGBAG_OK)
+    {
+        for (uint32_t i = 0; i < total; i++)
+        {
+            shard_of[i] = bigbag_shard_of(store, unsorted[i]);
+            starts[shard_of[i] + 1]++;
+        }
+        for (uint32_t i = 0; i < store->count; i++)
+            starts[i + 1] += starts[i];
+        memcpy(next, starts, (store->count + 1) * sizeof(uint32_t));
+        for (uint32_t i = 0; i < total; i++)
+            lines[next[shard_of[i]]++] = unsorted[i];
+
+        for (uint32_t i = 0; i < store->count; i++)
+        {
+            if (starts[i + 1] == starts[i])
+                continue;
+            struct shard_s *shard = &store->shards[i];
+            pthread_mutex_lock(&shard->lock);
+            int result = bigbag_add_batch(shard->bag, lines + starts[i], starts[i + 1] - starts[i]);
+            pthread_mutex_unlock(&shard->lock);
+            if (result == BIGBAG_OK)
+                added += starts[i + 1] - starts[i];
+            else
+                status = result;
+        }
+    }
+    if (count)
+        *count = added;
+    free(next);
+    free(lines);
+    free(starts);
+    free(unsorted);
+    free(shard_of);
+    free(data);
+    return status;
+}
+
+/**
+ * Visitor for mergeShards: copy an element to a shard_list_s.
+ * Stops the listing, with list->failed set, if the list can't grow.
+**/
+static bool collectElement(const char *element, void *arg)
+{
+    struct shard_list_s *list = arg;
+    size_t len = strlen(element) + 1;
+    if (list->len + len > list->cap)
+    {
+        size_t cap = (list->len + len) * 2;
+        char *data = realloc(list->data, cap);
+        if (!data)
+        {
+            list->failed = true;
+            return false;
+        }
+        list->data = data;
+        list->cap = cap;
+    }
+    memcpy(list->data + list->len, element, len);
+    list->len += len;
+    return true;
+}
+
+/**
+ * Return true if the next element of list a sorts before that of list b.
+**/
+static bool listBefore(struct shard_list_s *lists, uint32_t a, uint32_t b)
+{
+    return strcmp(lists[a].data + lists[a].pos, lists[b].data + lists[b].pos) < 0;
+}
+
+/**
+ * Move the list at heap[pos] down until both children sort after it.
+**/
+static void siftDown(struct shard_list_s *lists, uint32_t *heap, uint32_t size, uint32_t pos)
+{
+    for (;;)
+    {
+        uint32_t smallest = pos;
+        uint32_t left = 2 * pos + 1;
+        uint32_t right = left + 1;
+        if (left < size && listBefore(lists, heap[left], heap[smallest]))
+            smallest = left;
+        if (right < size && listBefore(lists, heap[right], heap[smallest]))
+            smallest = right;
+        if (smallest == pos)
+            return;
+        uint32_t swap = heap[pos];
+        heap[pos] = heap[smallest];
+        heap[smallest] = swap;
+        pos = smallest;
+    }
+}
+
+/**
+ * Call visit for the elements of every shard, sorted across the shards.
+ * Method:
+ * 1. Copy the matching elements out of each shard, locking one shard at
+ *    a time; each list is sorted
+ * 2. Put the non-empty lists in a min-heap keyed by their next element
+ * 3. Visit the element at the top of the heap, advance its list and
+ *    restore the heap, until the lists run out or visit returns false
+ *
+ * Each shard is read consistently, but changes to other shards can land
+ * in between: the listing is not a snapshot of the whole store.
+ *
+ * @param {bigbag_shards_s} store - the open store
+ * @param {int} query - QUERY_ALL, QUERY_RANGE or QUERY_PREFIX
+ * @param {char} lo - first element of a range, or the prefix
+ * @param {char} hi - last element of a range
+ * @param {bigbag_visit_f} visit - called for each element
+ * @param {void} arg - passed to visit
+**/
+static int mergeShards(struct bigbag_shards_s *store, int query, const char *lo, const char *hi,
+                       bigbag_visit_f visit, void *arg)
+{
+    struct shard_list_s *lists = calloc(store->count, sizeof(struct shard_list_s));
+    uint32_t *heap = malloc(store->count * sizeof(uint32_t));
+    uint32_t size = 0;
+    int status = lists && heap ? BIGBAG_OK : BIGBAG_ERR_IO;
+    for (uint32_t i = 0; i < store->count && status == BIGBAG_OK; i++)
+    {
+        struct shard_s *shard = &store->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        if (query == QUERY_RANGE)
+            status = bigbag_range(shard->bag, lo, hi, collectElement, &lists[i]);
+        else if (query == QUERY_PREFIX)
+            status = bigbag_prefix(shard->bag, lo, collectElement, &lists[i]);
+        else
+            status = bigbag_foreach(shard->bag, collectElement, &lists[i]);
+        pthread_mutex_unlock(&shard->lock);
+        if (lists[i].failed)
+            status = BIGBAG_ERR_IO;
+        if (lists[i].len)
+            heap[size++] = i;
+    }
+    if (status == BIGBAG_OK)
+    {
+        for (uint32_t pos = size / 2; pos-- > 0;)
+            siftDown(lists, heap, size, pos);
+        while (size)
+        {
+            struct shard_list_s *list = &lists[heap[0]];
+            char *element = list->data + list->pos;
+            if (!visit(element, arg))
+                break;
+            list->pos += strlen(element) + 1;
+            if (list->pos == list->len)
+                heap[0] = heap[--size];
+            siftDown(lists, heap, size, 0);
+        }
+    }
+    for (uint32_t i = 0; lists && i < store->count; i++)
+        free(lists[i].data);
+    free(lists);
+    free(heap);
+    return status;
+}
+
+/**
+ * Call visit for every element of the store in sorted order.
+**/
+int bigbag_shards_foreach(struct bigbag_shards_s *store, bigbag_visit_f visit, void *arg)
+{
+    return mergeShards(store, QUERY_ALL, NULL, NULL, visit, arg);
+}
+
+/**
+ * Call visit, in sorted order, for every element lo <= element <= hi.
+**/
+int bigbag_shards_range(struct bigbag_shards_s *store, const char *lo, const char *hi, bigbag_visit_f visit,
+                        void *arg)
+{
+    return mergeShards(store, QUERY_RANGE, lo, hi, visit, arg);
+}
+
+/**
+ * Call visit, in sorted order, for every element that starts with prefix.
+**/
+int bigbag_shards_prefix(struct bigbag_shards_s *store, const char *prefix, bigbag_visit_f visit, void *arg)
+{
+    return mergeShards(store, QUERY_PREFIX, prefix, NULL, visit, arg);
+}
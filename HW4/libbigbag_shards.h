@@ -0,0 +1,33 @@
+#include <stdbool.h>
+#include <stdint.h>
+#pragma once
+#include "libbigbag.h"
+
+/**
+ * Sharded stores: one bag per shard in a directory, each element in the
+ * shard its hash picks. Every call only locks the shards it touches, so
+ * threads working on different shards don't wait for each other.
+ * Build with libbigbag.c and libbigbag_shards.c, link with -lpthread.
+ *
+ * The number of shards is fixed when the store is created: the shards
+ * are the files shard-0000.bag, shard-0001.bag, ... of the directory.
+**/
+
+// An open sharded store
+struct bigbag_shards_s;
+
+struct bigbag_shards_s *bigbag_shards_open(const char *dirname, uint32_t shards,
+                                           const struct bigbag_options_s *options, int *status);
+int bigbag_shards_close(struct bigbag_shards_s *store);
+uint32_t bigbag_shards_count(struct bigbag_shards_s *store);
+uint32_t bigbag_shard_of(struct bigbag_shards_s *store, const char *element);
+
+int bigbag_shards_add(struct bigbag_shards_s *store, const char *element);
+int bigbag_shards_add_file(struct bigbag_shards_s *store, const char *filename, uint32_t *count);
+int bigbag_shards_delete(struct bigbag_shards_s *store, const char *element);
+int bigbag_shards_check(struct bigbag_shards_s *store, const char *element);
+// sorted across all shards
+int bigbag_shards_foreach(struct bigbag_shards_s *store, bigbag_visit_f visit, void *arg);
+int bigbag_shards_range(struct bigbag_shards_s *store, const char *lo, const char *hi, bigbag_visit_f visit,
+                        void *arg);
+int bigbag_shards_prefix(struct bigbag_shards_s *store, const char *prefix, bigbag_visit_f visit, void *arg);